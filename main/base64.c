@@ -119,6 +119,22 @@ char* basic_auth(const char* user, const char* passwd)
     return out;
 }
 
+char* b64_encode(const void* data, size_t len)
+{
+    struct b64_ctx ctx;
+    // b64_upd stops short of the end of its buffer; leave it some room
+    size_t alloc_size = b64_encode_len(len) + 4;
+    char* out = malloc(alloc_size);
+    if (!out)
+    {
+        return NULL;
+    }
+    b64_init(&ctx, out, alloc_size);
+    b64_upd(&ctx, data, len);
+    b64_final(&ctx);
+    return out;
+}
+
 #ifdef TEST
 #include <stdio.h>
 int main(int argc, char* argv[])
@@ -0,0 +1,137 @@
+/* Pilot Light Monitor
+ *
+ * Copyright 2023 Vernon Mauery <vernon@mauery.org>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+#include <esp_attr.h>
+#include <esp_log.h>
+#include <sdkconfig.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "capture.h"
+#include "https.h"
+
+extern const char* TAG;
+const char* device_id(void);
+char* b64_encode(const void* data, size_t len);
+
+// One high-rate capture of the flame channel, waiting in RTC memory
+// for the next upload. Samples are stored as zigzag-encoded deltas in
+// LEB128 varints; a thermocouple moves a few mV at most between
+// samples, so almost every sample takes a single byte.
+
+struct capture
+{
+    uint32_t sec;
+    uint16_t rate_hz;
+    uint16_t count;
+    uint16_t len;
+    uint8_t reason;
+    uint8_t state;
+    int16_t last;
+    uint8_t data[CAPTURE_MAX_BYTES];
+};
+
+enum
+{
+    CAPTURE_EMPTY,
+    CAPTURE_RUNNING,
+    CAPTURE_READY,
+};
+
+static RTC_DATA_ATTR struct capture cap;
+
+static const char* reason_name[] = {
+    [CAPTURE_FLAME_OUT] = "flame_out",
+    [CAPTURE_FLAME_ON] = "flame_on",
+    [CAPTURE_STEP] = "step",
+};
+
+// only one capture is kept; later events wait until it is uploaded
+int capture_pending(void)
+{
+    return cap.state != CAPTURE_EMPTY;
+}
+
+void capture_begin(time_t now, int reason, int rate_hz)
+{
+    cap.sec = now;
+    cap.rate_hz = rate_hz;
+    cap.reason = reason;
+    cap.count = 0;
+    cap.len = 0;
+    cap.last = 0;
+    cap.state = CAPTURE_RUNNING;
+}
+
+// Returns 0 once the buffer is full
+int capture_add(int sample)
+{
+    int delta = sample - cap.last;
+    uint32_t z = ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31);
+    uint8_t tmp[5];
+    int n = 0;
+    do
+    {
+        tmp[n++] = (z & 0x7f) | (z > 0x7f ? 0x80 : 0);
+        z >>= 7;
+    } while (z);
+    if (cap.len + n > CAPTURE_MAX_BYTES)
+    {
+        return 0;
+    }
+    memcpy(&cap.data[cap.len], tmp, n);
+    cap.len += n;
+    cap.count++;
+    cap.last = sample;
+    return 1;
+}
+
+void capture_end(void)
+{
+    cap.state = cap.count ? CAPTURE_READY : CAPTURE_EMPTY;
+    ESP_LOGI(TAG, "capture: %d samples in %d bytes", cap.count, cap.len);
+}
+
+// Returns 1 when there is nothing left to upload
+int capture_upload(time_t now)
+{
+    if (cap.state != CAPTURE_READY)
+    {
+        return 1;
+    }
+    char* data = b64_encode(cap.data, cap.len);
+    if (!data)
+    {
+        return 0;
+    }
+    static const char body_fmt[] =
+        "now=%lu\nsec=%lu\nreason=%s\nrate=%u\ncount=%u\ndata=%s\n";
+    size_t body_len = sizeof(body_fmt) + 64 + strlen(data);
+    char* body = malloc(body_len);
+    if (!body)
+    {
+        free(data);
+        return 0;
+    }
+    snprintf(body, body_len, body_fmt, (unsigned long)now,
+             (unsigned long)cap.sec, reason_name[cap.reason], cap.rate_hz,
+             cap.count, data);
+    free(data);
+    static const char uri_fmt[] = "%s/uptime/capture/?dev=%s";
+    char uri[sizeof(CONFIG_PLM_UPTIME_HOST) + sizeof(uri_fmt) + 16];
+    snprintf(uri, sizeof(uri), uri_fmt, CONFIG_PLM_UPTIME_HOST, device_id());
+    int status = https_post(uri, body, "text/plain", NULL, NULL);
+    free(body);
+    if (status < 200 || status >= 300)
+    {
+        return 0;
+    }
+    cap.state = CAPTURE_EMPTY;
+    return 1;
+}
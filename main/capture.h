@@ -0,0 +1,27 @@
+/* Pilot Light Monitor
+ *
+ * Copyright 2023 Vernon Mauery <vernon@mauery.org>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+
+// compressed capture storage kept in RTC memory
+#define CAPTURE_MAX_BYTES 1536
+
+enum capture_reason
+{
+    CAPTURE_FLAME_OUT,
+    CAPTURE_FLAME_ON,
+    CAPTURE_STEP,
+};
+
+int capture_pending(void);
+void capture_begin(time_t now, int reason, int rate_hz);
+int capture_add(int sample);
+void capture_end(void);
+int capture_upload(time_t now);
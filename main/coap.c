@@ -0,0 +1,294 @@
+/* Pilot Light Monitor
+ *
+ * Copyright 2023 Vernon Mauery <vernon@mauery.org>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+#include <sdkconfig.h>
+
+#if CONFIG_PLM_COAP
+
+#include <esp_attr.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <lwip/netdb.h>
+#include <lwip/sockets.h>
+#include <nvs.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/select.h>
+
+#include "coap.h"
+#include "devkey.h"
+#include "sim.h"
+
+extern const char* TAG;
+const char* device_id(void);
+
+// Routine reports as single CoAP datagrams (RFC 7252), for the uptime
+// host's coap-receiver.php. A report is a confirmable POST to the same
+// path it would have over HTTPS, with the device ID as a query and the
+// log line as the payload. Each one is signed with HMAC-SHA256 under a
+// per-device key and carries a counter that only goes up, so the
+// server can turn away a replayed datagram. The counter's high word
+// counts cold boots in NVS and the low word counts messages in RTC
+// memory, so neither a deep sleep nor a power cut can reuse one.
+//
+// request:  header, token, Uri-Path..., Uri-Query "dev=<id>", 0xff,
+//           counter (8 bytes, big endian), log line, MAC (16 bytes)
+// ack:      header, token, 0xff, MAC (16 bytes)
+//
+// The MAC is the truncated HMAC of everything before it; the ack's
+// also covers the request's MAC, which ties it to that request.
+
+#define COAP_VERSION 1
+#define COAP_TYPE_CON 0
+#define COAP_TYPE_ACK 2
+#define COAP_POST 0x02
+#define COAP_CHANGED 0x44 // 2.04
+#define COAP_OPT_URI_PATH 11
+#define COAP_OPT_URI_QUERY 15
+#define COAP_PAYLOAD 0xff
+
+#define COAP_TOKEN_LEN 4
+#define COAP_MAC_LEN DEVKEY_MAC_LEN
+#define COAP_MAX_LEN 384
+#define COAP_ATTEMPTS 2
+#define COAP_ACK_TIMEOUT_MS 1000
+
+static RTC_DATA_ATTR uint64_t coap_counter;
+static RTC_DATA_ATTR uint16_t coap_msg_id;
+static RTC_DATA_ATTR int coap_epoch_ok;
+
+void coap_init(int cold_boot)
+{
+    if (cold_boot)
+    {
+        coap_counter = 0;
+        coap_epoch_ok = 0;
+    }
+}
+
+// count this boot in NVS, once per cold boot; NVS is up by the time
+// there is a network to send on
+static int coap_epoch(void)
+{
+    if (coap_epoch_ok)
+    {
+        return 0;
+    }
+    nvs_handle_t h;
+    if (nvs_open("plm", NVS_READWRITE, &h) != ESP_OK)
+    {
+        return -1;
+    }
+    uint32_t boots = 0;
+    // not there yet on the first boot
+    nvs_get_u32(h, "coap_boots", &boots);
+    boots++;
+    esp_err_t err = nvs_set_u32(h, "coap_boots", boots);
+    if (err == ESP_OK)
+    {
+        err = nvs_commit(h);
+    }
+    nvs_close(h);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "coap: can't save boot count: %s", esp_err_to_name(err));
+        return -1;
+    }
+    coap_counter = (uint64_t)boots << 32;
+    coap_msg_id = boots << 8;
+    coap_epoch_ok = 1;
+    return 0;
+}
+
+// append an option; deltas and lengths here stay under 269
+static uint8_t* coap_opt(uint8_t* p, int* last, int num, const char* val,
+                         size_t len)
+{
+    int delta = num - *last;
+    *last = num;
+    uint8_t* h = p++;
+    int dn = delta;
+    int ln = len;
+    if (delta >= 13)
+    {
+        *p++ = delta - 13;
+        dn = 13;
+    }
+    if (len >= 13)
+    {
+        *p++ = len - 13;
+        ln = 13;
+    }
+    *h = (dn << 4) | ln;
+    memcpy(p, val, len);
+    return p + len;
+}
+
+// Build the request into buf; returns its length, or 0 if it won't fit
+static size_t coap_build(uint8_t* buf, const uint8_t* key, int key_len,
+                         const char* path, const char* text)
+{
+    size_t text_len = text ? strlen(text) : 0;
+    if (strlen(path) + text_len + 64 > COAP_MAX_LEN)
+    {
+        return 0;
+    }
+    uint8_t* p = buf;
+    *p++ = (COAP_VERSION << 6) | (COAP_TYPE_CON << 4) | COAP_TOKEN_LEN;
+    *p++ = COAP_POST;
+    *p++ = coap_msg_id >> 8;
+    *p++ = coap_msg_id & 0xff;
+    for (int i = 0; i < COAP_TOKEN_LEN; i++)
+    {
+        *p++ = coap_counter >> (8 * (COAP_TOKEN_LEN - 1 - i));
+    }
+    int last = 0;
+    while (*path)
+    {
+        const char* end = strchr(path, '/');
+        size_t len = end ? (size_t)(end - path) : strlen(path);
+        if (len)
+        {
+            p = coap_opt(p, &last, COAP_OPT_URI_PATH, path, len);
+        }
+        path += len + (end ? 1 : 0);
+    }
+    char q[24];
+    int qlen = snprintf(q, sizeof(q), "dev=%s", device_id());
+    p = coap_opt(p, &last, COAP_OPT_URI_QUERY, q, qlen);
+    *p++ = COAP_PAYLOAD;
+    for (int i = 7; i >= 0; i--)
+    {
+        *p++ = coap_counter >> (8 * i);
+    }
+    memcpy(p, text, text_len);
+    p += text_len;
+    devkey_mac(key, key_len, buf, p - buf, NULL, 0, p);
+    return p + COAP_MAC_LEN - buf;
+}
+
+static int coap_ack_ok(const uint8_t* ack, int len, const uint8_t* req,
+                       size_t req_len, const uint8_t* key, int key_len)
+{
+    const int head = 4 + COAP_TOKEN_LEN + 1;
+    if (len != head + COAP_MAC_LEN ||
+        ack[0] != ((COAP_VERSION << 6) | (COAP_TYPE_ACK << 4) |
+                   COAP_TOKEN_LEN) ||
+        ack[1] != COAP_CHANGED || memcmp(ack + 2, req + 2, 2) ||
+        memcmp(ack + 4, req + 4, COAP_TOKEN_LEN) || ack[head - 1] != 0xff)
+    {
+        return 0;
+    }
+    uint8_t mac[COAP_MAC_LEN];
+    devkey_mac(key, key_len, ack, head, req + req_len - COAP_MAC_LEN,
+               COAP_MAC_LEN, mac);
+    return memcmp(mac, ack + head, COAP_MAC_LEN) == 0;
+}
+
+// the host part of "[https://]host[/path]"
+static int coap_host(char* host, size_t size)
+{
+    const char* h = CONFIG_PLM_UPTIME_HOST;
+    const char* s = strstr(h, "://");
+    h = s ? s + 3 : h;
+    size_t len = strcspn(h, "/:");
+    if (len == 0 || len >= size)
+    {
+        return -1;
+    }
+    memcpy(host, h, len);
+    host[len] = 0;
+    return 0;
+}
+
+// Send one report to path (as for HTTPS) and wait for the server's
+// signed ack. Returns 0 once it is acked; otherwise the caller sends it
+// some other way. counter gets the one the datagram carried, or 0 if
+// none went out; the server can match the other way's copy against it.
+int coap_send(const char* path, const char* text, uint64_t* counter)
+{
+    *counter = 0;
+    uint8_t key[DEVKEY_MAX];
+    int key_len = devkey_get(key);
+    char host[64];
+    if (key_len < 0 || coap_host(host, sizeof(host)) < 0 || coap_epoch() < 0)
+    {
+        return -1;
+    }
+    int64_t start = esp_timer_get_time();
+    uint8_t req[COAP_MAX_LEN];
+    coap_counter++;
+    coap_msg_id++;
+    size_t req_len = coap_build(req, key, key_len, path, text);
+    if (!req_len)
+    {
+        return -1;
+    }
+    *counter = coap_counter;
+
+    char port[8];
+    snprintf(port, sizeof(port), "%d", CONFIG_PLM_COAP_PORT);
+    struct addrinfo hints = {
+        .ai_family = AF_INET,
+        .ai_socktype = SOCK_DGRAM,
+    };
+    struct addrinfo* res = NULL;
+    if (getaddrinfo(host, port, &hints, &res) != 0 || !res)
+    {
+        ESP_LOGE(TAG, "coap: can't resolve %s", host);
+        return -1;
+    }
+    int fd = socket(res->ai_family, res->ai_socktype, 0);
+    if (fd < 0)
+    {
+        freeaddrinfo(res);
+        return -1;
+    }
+    int acked = 0;
+    for (int i = 0; i < COAP_ATTEMPTS && !acked; i++)
+    {
+        if (sendto(fd, req, req_len, 0, res->ai_addr, res->ai_addrlen) < 0)
+        {
+            break;
+        }
+        // the radio only has to stay up for one round trip
+        int64_t deadline =
+            esp_timer_get_time() + (COAP_ACK_TIMEOUT_MS << i) * 1000LL;
+        int64_t left;
+        while (!acked && (left = deadline - esp_timer_get_time()) > 0)
+        {
+            fd_set rfds;
+            FD_ZERO(&rfds);
+            FD_SET(fd, &rfds);
+            struct timeval tv = {
+                .tv_sec = left / 1000000,
+                .tv_usec = left % 1000000,
+            };
+            if (select(fd + 1, &rfds, NULL, NULL, &tv) <= 0)
+            {
+                break;
+            }
+            uint8_t ack[64];
+            int n = recv(fd, ack, sizeof(ack), 0);
+            acked = n > 0 &&
+                    coap_ack_ok(ack, n, req, req_len, key, key_len);
+        }
+    }
+    close(fd);
+    freeaddrinfo(res);
+    ESP_LOGI(TAG, "coap %s: %s, %u bytes, %lld ms", path,
+             (acked ? "acked" : "no ack"), (unsigned)req_len,
+             (esp_timer_get_time() - start) / 1000);
+#if CONFIG_PLM_QEMU
+    sim_coap_done(acked);
+#endif
+    return acked ? 0 : -1;
+}
+
+#endif
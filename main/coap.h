@@ -0,0 +1,13 @@
+/* Pilot Light Monitor
+ *
+ * Copyright 2023 Vernon Mauery <vernon@mauery.org>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+#pragma once
+
+#include <stdint.h>
+
+void coap_init(int cold_boot);
+int coap_send(const char* path, const char* text, uint64_t* counter);
@@ -0,0 +1,55 @@
+/* Pilot Light Monitor
+ *
+ * Copyright 2023 Vernon Mauery <vernon@mauery.org>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+#pragma once
+
+#include <stdint.h>
+
+#include "filter.h"
+
+// One-sided CUSUM change detector for a drop below a reference level.
+//
+// Each sample adds its shortfall below ref, less an allowed drift, to a
+// running sum that never goes below zero; the detector alarms once the
+// sum passes the threshold. Readings that sit a little below ref now
+// and then leak away through the drift, while a real drop adds up in a
+// few samples. A bigger threshold means fewer false alarms and a slower
+// detection. The sum is capped at twice the threshold so it clears soon
+// after the level comes back. All values are Q10, like filter.h.
+
+struct cusum
+{
+    int32_t sum;
+    int32_t ref;
+    int32_t drift;
+    int32_t threshold;
+};
+
+FILTER_INLINE void cusum_init(struct cusum* c, int32_t ref, int32_t drift,
+                              int32_t threshold)
+{
+    c->sum = 0;
+    c->ref = ref;
+    c->drift = drift;
+    c->threshold = threshold;
+}
+
+// returns 1 while the detector is in alarm
+FILTER_INLINE int cusum_update(struct cusum* c, int32_t x)
+{
+    int32_t s = c->sum + (c->ref - x) - c->drift;
+    if (s < 0)
+    {
+        s = 0;
+    }
+    else if (s > 2 * c->threshold)
+    {
+        s = 2 * c->threshold;
+    }
+    c->sum = s;
+    return s > c->threshold;
+}
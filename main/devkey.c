@@ -0,0 +1,76 @@
+/* Pilot Light Monitor
+ *
+ * Copyright 2023 Vernon Mauery <vernon@mauery.org>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+#include <esp_log.h>
+#include <mbedtls/md.h>
+#include <sdkconfig.h>
+#include <string.h>
+
+#include "devkey.h"
+
+extern const char* TAG;
+
+// The per-device key (PLM_DEVICE_KEY) that alerts and CoAP reports are
+// signed with. The uptime host keeps a copy in its device_keys table, so
+// it can tell them from anyone else's.
+
+static int hex_nibble(char c)
+{
+    switch (c)
+    {
+        case '0' ... '9':
+            return c - '0';
+        case 'a' ... 'f':
+            return c - 'a' + 10;
+        case 'A' ... 'F':
+            return c - 'A' + 10;
+    }
+    return -1;
+}
+
+// the device key from menuconfig; returns its length or -1
+int devkey_get(uint8_t* key)
+{
+    static const char hex[] = CONFIG_PLM_DEVICE_KEY;
+    size_t len = strlen(hex) / 2;
+    if (strlen(hex) % 2 || len < 16 || len > DEVKEY_MAX)
+    {
+        ESP_LOGE(TAG, "PLM_DEVICE_KEY must be 32 to 64 hex digits");
+        return -1;
+    }
+    for (size_t i = 0; i < len; i++)
+    {
+        int hi = hex_nibble(hex[2 * i]);
+        int lo = hex_nibble(hex[2 * i + 1]);
+        if (hi < 0 || lo < 0)
+        {
+            return -1;
+        }
+        key[i] = (hi << 4) | lo;
+    }
+    return len;
+}
+
+// HMAC-SHA256 of a then b, truncated to DEVKEY_MAC_LEN bytes
+void devkey_mac(const uint8_t* key, int key_len, const uint8_t* a,
+                size_t a_len, const uint8_t* b, size_t b_len, uint8_t* mac)
+{
+    uint8_t full[32];
+    mbedtls_md_context_t ctx;
+    mbedtls_md_init(&ctx);
+    mbedtls_md_setup(&ctx, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 1);
+    mbedtls_md_hmac_starts(&ctx, key, key_len);
+    mbedtls_md_hmac_update(&ctx, a, a_len);
+    if (b_len)
+    {
+        mbedtls_md_hmac_update(&ctx, b, b_len);
+    }
+    mbedtls_md_hmac_finish(&ctx, full);
+    mbedtls_md_free(&ctx);
+    memcpy(mac, full, DEVKEY_MAC_LEN);
+}
@@ -0,0 +1,18 @@
+/* Pilot Light Monitor
+ *
+ * Copyright 2023 Vernon Mauery <vernon@mauery.org>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DEVKEY_MAX 32
+#define DEVKEY_MAC_LEN 16
+
+int devkey_get(uint8_t* key);
+void devkey_mac(const uint8_t* key, int key_len, const uint8_t* a,
+                size_t a_len, const uint8_t* b, size_t b_len, uint8_t* mac);
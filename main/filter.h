@@ -0,0 +1,179 @@
+/* Pilot Light Monitor
+ *
+ * Copyright 2023 Vernon Mauery <vernon@mauery.org>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+#pragma once
+
+#include <stdint.h>
+
+// Fixed-point filters for the ADC readings. Samples go in as whole
+// millivolts and filter values come out in Q10 (mV * FIXED_POINT).
+// Window sizes are powers of two so that averaging is a shift, and the
+// shifts are fixed here so they compile to immediates. Filter state is
+// plain data, so a filter can live in RTC memory and keep going across
+// deep sleep.
+
+#define FILTER_Q 10
+#define FIXED_POINT (1 << FILTER_Q)
+
+#define FILTER_INLINE static inline __attribute__((always_inline))
+
+// closest whole number to a Q10 value
+FILTER_INLINE int q_round(int32_t v)
+{
+    return (v + FIXED_POINT / 2) >> FILTER_Q;
+}
+// whole part of a (positive) Q10 value
+FILTER_INLINE int q_whole(int32_t v)
+{
+    return v >> FILTER_Q;
+}
+// thousandths in the fractional part of a (positive) Q10 value
+FILTER_INLINE int q_millis(int32_t v)
+{
+    return (1000 * (v & (FIXED_POINT - 1))) >> FILTER_Q;
+}
+
+/*---------------------------------------------------------------
+        Exponential moving average
+---------------------------------------------------------------*/
+// value += (sample - value) / 2^EMA_SHIFT, rounded to nearest so a
+// steady input is approached from either side without bias. A shift of
+// 3 has the time constant of the old window of 8.
+#define EMA_SHIFT 3
+
+struct ema
+{
+    int32_t value;
+    uint8_t primed;
+};
+
+FILTER_INLINE void ema_init(struct ema* f)
+{
+    f->value = 0;
+    f->primed = 0;
+}
+
+FILTER_INLINE void ema_update(struct ema* f, int sample)
+{
+    int32_t x = sample * FIXED_POINT;
+    if (!f->primed)
+    {
+        // start at the first sample instead of ramping up from zero
+        f->value = x;
+        f->primed = 1;
+        return;
+    }
+    f->value += (x - f->value + (1 << (EMA_SHIFT - 1))) >> EMA_SHIFT;
+}
+
+/*---------------------------------------------------------------
+        Median of the last N samples, for spike rejection
+---------------------------------------------------------------*/
+#define MEDIAN_MAX 5
+
+struct median
+{
+    int16_t samples[MEDIAN_MAX];
+    uint8_t size;
+    uint8_t count;
+    uint8_t next;
+};
+
+FILTER_INLINE void median_init(struct median* f, int size)
+{
+    f->size = size;
+    f->count = 0;
+    f->next = 0;
+}
+
+// add a sample and return the median of the ones in the window; the
+// window is short, so an insertion sort of a copy is the cheapest way
+FILTER_INLINE int median_update(struct median* f, int sample)
+{
+    f->samples[f->next] = sample;
+    f->next = (f->next + 1) % f->size;
+    if (f->count < f->size)
+    {
+        f->count++;
+    }
+    int16_t s[MEDIAN_MAX];
+    for (int i = 0; i < f->count; i++)
+    {
+        int16_t v = f->samples[i];
+        int j = i;
+        for (; j > 0 && s[j - 1] > v; j--)
+        {
+            s[j] = s[j - 1];
+        }
+        s[j] = v;
+    }
+    int mid = f->count / 2;
+    if (f->count & 1)
+    {
+        return s[mid];
+    }
+    return (s[mid - 1] + s[mid] + 1) / 2;
+}
+
+/*---------------------------------------------------------------
+        Windowed mean over the last 2^WMEAN_ORDER samples
+---------------------------------------------------------------*/
+#define WMEAN_ORDER 5
+#define WMEAN_SIZE (1 << WMEAN_ORDER)
+
+struct wmean
+{
+    int32_t value;
+    int32_t sum;
+    uint16_t count;
+    uint16_t next;
+    int16_t samples[WMEAN_SIZE];
+};
+
+FILTER_INLINE void wmean_init(struct wmean* f)
+{
+    f->value = 0;
+    f->sum = 0;
+    f->count = 0;
+    f->next = 0;
+}
+
+// the value wmean_update would give for this sample, without adding it
+FILTER_INLINE int32_t wmean_next(const struct wmean* f, int sample)
+{
+    int32_t sum = f->sum + sample;
+    if (f->count == WMEAN_SIZE)
+    {
+        return ((sum - f->samples[f->next]) * FIXED_POINT) >> WMEAN_ORDER;
+    }
+    return (sum * FIXED_POINT + (f->count + 1) / 2) / (f->count + 1);
+}
+
+FILTER_INLINE void wmean_update(struct wmean* f, int sample)
+{
+    if (f->count == WMEAN_SIZE)
+    {
+        f->sum -= f->samples[f->next];
+    }
+    else
+    {
+        f->count++;
+    }
+    f->samples[f->next] = sample;
+    f->sum += sample;
+    f->next = (f->next + 1) & (WMEAN_SIZE - 1);
+    if (f->count == WMEAN_SIZE)
+    {
+        // FILTER_Q >= WMEAN_ORDER, so this is exact
+        f->value = (f->sum * FIXED_POINT) >> WMEAN_ORDER;
+    }
+    else
+    {
+        // only while the window first fills
+        f->value = (f->sum * FIXED_POINT + f->count / 2) / f->count;
+    }
+}
@@ -6,152 +6,613 @@
  *
  */
 
-#include <esp_event.h>
-#include <esp_http_client.h>
+#include <esp_heap_caps.h>
 #include <esp_log.h>
-#include <esp_netif.h>
-#include <esp_system.h>
+#include <esp_timer.h>
 #include <esp_tls.h>
-#include <freertos/FreeRTOS.h>
-#include <freertos/task.h>
-#include <nvs_flash.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/select.h>
 #if CONFIG_MBEDTLS_CERTIFICATE_BUNDLE
 #include <esp_crt_bundle.h>
 #endif
 
+#include "https.h"
+#include "sim.h"
+
 extern const char* TAG;
-esp_err_t _http_event_handler(esp_http_client_event_t* evt)
+
+// Requests are driven by https_run(). Each one steps through connect,
+// TLS handshake, send and receive on a non-blocking socket; whenever
+// none of them can make progress the task blocks in select() on all of
+// their sockets, so the CPU is free to light sleep between packets and
+// a slow server doesn't hold up a request to another one.
+
+static esp_tls_cfg_t tls_cfg = {
+    .non_block = true,
+    // esp-tls does one select() of its own while the TCP connect is in
+    // progress; https_run only steps a connecting request once its
+    // socket is writable, so this just keeps that select from blocking
+    .timeout_ms = 10,
+#if !CONFIG_PLM_TLS_PINNED_CA && CONFIG_MBEDTLS_CERTIFICATE_BUNDLE
+    .crt_bundle_attach = esp_crt_bundle_attach,
+#endif
+};
+
+#if CONFIG_PLM_TLS_PINNED_CA
+// main/certs/uptime_ca.pem, the one CA the uptime host is checked against
+extern const char uptime_ca_pem_start[] asm("_binary_uptime_ca_pem_start");
+extern const char uptime_ca_pem_end[] asm("_binary_uptime_ca_pem_end");
+#define TRUST_NAME "pinned CA"
+#else
+#define TRUST_NAME "CA bundle"
+#endif
+
+static void https_trust(void)
+{
+#if CONFIG_PLM_TLS_PINNED_CA
+    // the length includes the NUL that marks it as PEM for mbedTLS
+    tls_cfg.cacert_buf = (const unsigned char*)uptime_ca_pem_start;
+    tls_cfg.cacert_bytes = uptime_ca_pem_end - uptime_ca_pem_start;
+#endif
+}
+
+// Split "[https://]host[:port][/path]" into the host, the port and the
+// rest; returns the path, or NULL if the host doesn't fit
+static const char* https_split(const char* url, char* host, size_t len,
+                               int* port)
 {
-    static char* output_buffer; // Buffer to store response of http request from
-                                // event handler
-    switch (evt->event_id)
+    static const char scheme[] = "https://";
+    if (strncmp(url, scheme, sizeof(scheme) - 1) == 0)
     {
-        case HTTP_EVENT_ERROR:
-            ESP_LOGD(TAG, "HTTP_EVENT_ERROR");
-            break;
-        case HTTP_EVENT_ON_CONNECTED:
-            ESP_LOGD(TAG, "HTTP_EVENT_ON_CONNECTED");
-            break;
-        case HTTP_EVENT_HEADER_SENT:
-            ESP_LOGD(TAG, "HTTP_EVENT_HEADER_SENT");
-            break;
-        case HTTP_EVENT_ON_HEADER:
-            ESP_LOGD(TAG, "HTTP_EVENT_ON_HEADER, key=%s, value=%s",
-                     evt->header_key, evt->header_value);
-            break;
-        case HTTP_EVENT_ON_DATA:
-            ESP_LOGD(TAG, "HTTP_EVENT_ON_DATA, len=%d", evt->data_len);
-            break;
-        case HTTP_EVENT_ON_FINISH:
-            ESP_LOGD(TAG, "HTTP_EVENT_ON_FINISH");
-            if (output_buffer != NULL)
+        url += sizeof(scheme) - 1;
+    }
+    const char* path = strchr(url, '/');
+    size_t host_len = path ? (size_t)(path - url) : strlen(url);
+    const char* colon = memchr(url, ':', host_len);
+    *port = 443;
+    if (colon)
+    {
+        *port = atoi(colon + 1);
+        host_len = colon - url;
+    }
+    if (host_len == 0 || host_len >= len || *port <= 0 || *port > 65535)
+    {
+        return NULL;
+    }
+    memcpy(host, url, host_len);
+    host[host_len] = 0;
+    return path ? path : "/";
+}
+
+// Build the request; data may be NULL for a request with no body.
+// Returns 0, or -1 if it couldn't be built.
+int https_req_init(struct https_req* r, const char* method, const char* url,
+                   const char* query, const char* data,
+                   const char* content_type, const char* auth)
+{
+    memset(r, 0, sizeof(*r));
+    r->status = -1;
+    r->state = HTTPS_DONE;
+    int port;
+    const char* path = https_split(url, r->host, sizeof(r->host), &port);
+    if (!path)
+    {
+        ESP_LOGE(TAG, "bad url: %s", url);
+        return -1;
+    }
+    size_t data_len = data ? strlen(data) : 0;
+    size_t max_len = strlen(method) + strlen(path) + strlen(r->host) +
+                     (query ? strlen(query) : 0) +
+                     (content_type ? strlen(content_type) : 0) +
+                     (auth ? strlen(auth) : 0) + data_len + 160;
+    r->msg = malloc(max_len);
+    if (!r->msg)
+    {
+        return -1;
+    }
+    r->port = port;
+    int n = snprintf(r->msg, max_len,
+                     "%s %s%s%s HTTP/1.1\r\n"
+                     "Host: %s",
+                     method, path, (query ? "?" : ""), (query ? query : ""),
+                     r->host);
+    if (port != 443)
+    {
+        n += snprintf(r->msg + n, max_len - n, ":%d", port);
+    }
+    n += snprintf(r->msg + n, max_len - n,
+                  "\r\n"
+                  "User-Agent: pilot-light-monitor\r\n"
+                  "Connection: close\r\n");
+    if (auth)
+    {
+        n += snprintf(r->msg + n, max_len - n, "Authorization: %s\r\n", auth);
+    }
+    if (data)
+    {
+        n += snprintf(r->msg + n, max_len - n,
+                      "Content-Type: %s\r\nContent-Length: %u\r\n",
+                      content_type, (unsigned)data_len);
+    }
+    n += snprintf(r->msg + n, max_len - n, "\r\n");
+    if (data)
+    {
+        memcpy(r->msg + n, data, data_len);
+    }
+    r->len = n + data_len;
+    r->state = HTTPS_QUEUED;
+    return 0;
+}
+
+void https_req_free(struct https_req* r)
+{
+    if (r->tls)
+    {
+        esp_tls_conn_destroy(r->tls);
+        r->tls = NULL;
+    }
+    free(r->msg);
+    r->msg = NULL;
+    free(r->location);
+    r->location = NULL;
+}
+
+#define HTTPS_WANT_READ 1
+#define HTTPS_WANT_WRITE 2
+
+static void https_finish(struct https_req* r, int status)
+{
+    r->status = status;
+    r->state = HTTPS_DONE;
+    r->t_done = esp_timer_get_time();
+    if (r->tls)
+    {
+        esp_tls_conn_destroy(r->tls);
+        r->tls = NULL;
+    }
+    // steps that never happened show up as -1
+    int64_t tcp = r->t_tcp ? (r->t_tcp - r->t_start) / 1000 : -1;
+    int64_t tls = r->t_tls ? (r->t_tls - r->t_tcp) / 1000 : -1;
+    int64_t reply = r->t_sent ? (r->t_done - r->t_sent) / 1000 : -1;
+    ESP_LOGI(TAG,
+             "https %s: status %d, %u bytes, connect %lld ms, tls %lld ms, "
+             "reply %lld ms, total %lld ms",
+             r->host, status, (unsigned)r->len, tcp, tls, reply,
+             (r->t_done - r->t_start) / 1000);
+#if CONFIG_PLM_QEMU
+    sim_https_done(status);
+#endif
+}
+
+#define HTTPS_MAX_REDIRECTS 3
+
+static int https_is_redirect(int status)
+{
+    return status == 301 || status == 302 || status == 307 || status == 308;
+}
+
+// Point the request at its Location and start it over, with the same
+// method, headers and body. Only https is followed. Returns 0, or -1 if
+// it can't be followed.
+static int https_redirect(struct https_req* r)
+{
+    char host[HTTPS_HOST_LEN];
+    int port = r->port;
+    const char* path = r->location;
+    if (path[0] == '/')
+    {
+        strcpy(host, r->host);
+    }
+    else if (strncmp(path, "https://", 8) == 0)
+    {
+        path = https_split(r->location, host, sizeof(host), &port);
+    }
+    else
+    {
+        path = NULL;
+    }
+    // everything from the end of the Host header on carries over
+    const char* sp = strchr(r->msg, ' ');
+    const char* rest = strstr(r->msg, "\r\nHost: ");
+    rest = rest ? strstr(rest + 2, "\r\n") : NULL;
+    if (!path || !sp || !rest)
+    {
+        ESP_LOGE(TAG, "https %s: can't follow redirect to %s", r->host,
+                 r->location);
+        return -1;
+    }
+    size_t rest_len = r->msg + r->len - rest;
+    size_t max_len = (sp - r->msg) + strlen(path) + strlen(host) + rest_len +
+                     32;
+    char* msg = malloc(max_len);
+    if (!msg)
+    {
+        return -1;
+    }
+    int n = snprintf(msg, max_len, "%.*s %s HTTP/1.1\r\nHost: %s",
+                     (int)(sp - r->msg), r->msg, path, host);
+    if (port != 443)
+    {
+        n += snprintf(msg + n, max_len - n, ":%d", port);
+    }
+    memcpy(msg + n, rest, rest_len);
+    ESP_LOGI(TAG, "https %s: %d, following to %s", r->host, r->status,
+             r->location);
+
+    esp_tls_conn_destroy(r->tls);
+    free(r->msg);
+    free(r->location);
+    int redirects = r->redirects + 1;
+    memset(r, 0, sizeof(*r));
+    strcpy(r->host, host);
+    r->port = port;
+    r->msg = msg;
+    r->len = n + rest_len;
+    r->status = -1;
+    r->redirects = redirects;
+    r->state = HTTPS_QUEUED;
+    return 0;
+}
+
+// Look at what came back a header line at a time; only the status line
+// and a redirect's Location matter, and the body is thrown away
+static void https_parse(struct https_req* r, const char* buf, int len)
+{
+    for (int i = 0; i < len; i++)
+    {
+        char c = buf[i];
+        if (c != '\n')
+        {
+            if (c == '\r')
             {
-                // Response is accumulated in output_buffer. Uncomment the below
-                // line to print the accumulated response
-                // ESP_LOG_BUFFER_HEX(TAG, output_buffer, output_len);
-                free(output_buffer);
-                output_buffer = NULL;
+                continue;
             }
-            break;
-        case HTTP_EVENT_DISCONNECTED:
-            ESP_LOGI(TAG, "HTTP_EVENT_DISCONNECTED");
-            int mbedtls_err = 0;
-            esp_err_t err = esp_tls_get_and_clear_last_error(
-                (esp_tls_error_handle_t)evt->data, &mbedtls_err, NULL);
-            if (err != 0)
+            if (r->line_len < sizeof(r->line) - 1)
             {
-                ESP_LOGI(TAG, "Last esp error code: 0x%x", err);
-                ESP_LOGI(TAG, "Last mbedtls failure: 0x%x", mbedtls_err);
+                r->line[r->line_len++] = c;
             }
-            if (output_buffer != NULL)
+            else
             {
-                free(output_buffer);
-                output_buffer = NULL;
+                r->line_long = 1;
             }
-            break;
-        case HTTP_EVENT_REDIRECT:
-            ESP_LOGD(TAG, "HTTP_EVENT_REDIRECT");
-            esp_http_client_set_header(evt->client, "From", "user@example.com");
-            esp_http_client_set_header(evt->client, "Accept", "text/html");
-            esp_http_client_set_redirection(evt->client);
-            break;
+            continue;
+        }
+        r->line[r->line_len] = 0;
+        int empty = (r->line_len == 0);
+        int whole = !r->line_long;
+        r->line_len = 0;
+        r->line_long = 0;
+        if (empty)
+        {
+            // the end of the headers
+            if (https_is_redirect(r->status) && r->location &&
+                r->redirects < HTTPS_MAX_REDIRECTS && https_redirect(r) == 0)
+            {
+                return;
+            }
+            https_finish(r, r->status);
+            return;
+        }
+        if (r->lines++ == 0)
+        {
+            // "HTTP/1.1 200 OK"
+            if (sscanf(r->line, "HTTP/%*d.%*d %d", &r->status) != 1)
+            {
+                r->status = -1;
+            }
+        }
+        else if (whole && !r->location &&
+                 strncasecmp(r->line, "Location:", 9) == 0)
+        {
+            const char* v = r->line + 9;
+            while (*v == ' ' || *v == '\t')
+            {
+                v++;
+            }
+            r->location = strdup(v);
+        }
     }
-    return ESP_OK;
 }
 
-char* basic_auth(const char* user, const char* passwd);
-
-void https_post(const char* uri, const char* data, const char* content_type,
-                const char* user, const char* passwd)
+// Move a request along as far as it can go without blocking. Returns
+// what it is waiting for, or 0 once it is done.
+static int https_step(struct https_req* r)
 {
-    esp_http_client_config_t config = {
-        .url = uri,
-        .event_handler = _http_event_handler,
-        .crt_bundle_attach = esp_crt_bundle_attach,
-        .is_async = true,
-        .timeout_ms = 5000,
-    };
-    esp_http_client_handle_t client = esp_http_client_init(&config);
-    esp_err_t err;
-    esp_http_client_set_method(client, HTTP_METHOD_POST);
-    esp_http_client_set_post_field(client, data, strlen(data));
-    esp_http_client_set_header(client, "Content-type", content_type);
-    if (user || passwd)
+    switch (r->state)
     {
-        char* auth = basic_auth(user, passwd);
-        esp_http_client_set_header(client, "Authorization", auth);
-        free(auth);
+        case HTTPS_QUEUED:
+            r->t_start = esp_timer_get_time();
+            r->tls = esp_tls_init();
+            if (!r->tls)
+            {
+                https_finish(r, -1);
+                return 0;
+            }
+            r->state = HTTPS_CONNECTING;
+            /* fall through */
+        case HTTPS_CONNECTING:
+        {
+            // the first call looks up the host, which does block
+            int ret = esp_tls_conn_new_async(r->host, strlen(r->host),
+                                             r->port, &tls_cfg, r->tls);
+            esp_tls_conn_state_t cs = ESP_TLS_FAIL;
+            esp_tls_get_conn_state(r->tls, &cs);
+            if (!r->t_tcp && (ret > 0 || cs == ESP_TLS_HANDSHAKE))
+            {
+                r->t_tcp = esp_timer_get_time();
+            }
+            if (ret < 0)
+            {
+                ESP_LOGE(TAG, "https %s: connection failed", r->host);
+                https_finish(r, -1);
+                return 0;
+            }
+            if (ret == 0)
+            {
+                // the handshake is mostly waiting on the server
+                return cs == ESP_TLS_CONNECTING ? HTTPS_WANT_WRITE
+                                                : HTTPS_WANT_READ;
+            }
+            r->t_tls = esp_timer_get_time();
+            r->state = HTTPS_SENDING;
+        }
+            /* fall through */
+        case HTTPS_SENDING:
+            while (r->sent < r->len)
+            {
+                ssize_t n = esp_tls_conn_write(r->tls, r->msg + r->sent,
+                                               r->len - r->sent);
+                if (n == ESP_TLS_ERR_SSL_WANT_WRITE)
+                {
+                    return HTTPS_WANT_WRITE;
+                }
+                if (n == ESP_TLS_ERR_SSL_WANT_READ)
+                {
+                    return HTTPS_WANT_READ;
+                }
+                if (n < 0)
+                {
+                    ESP_LOGE(TAG, "https %s: write failed: -0x%x", r->host,
+                             (unsigned)-n);
+                    https_finish(r, -1);
+                    return 0;
+                }
+                r->sent += n;
+            }
+            r->t_sent = esp_timer_get_time();
+            r->state = HTTPS_RECEIVING;
+            /* fall through */
+        case HTTPS_RECEIVING:
+            // keep reading while mbedTLS has data; select() only knows
+            // about what is still in the socket
+            while (r->state == HTTPS_RECEIVING)
+            {
+                char buf[128];
+                ssize_t n = esp_tls_conn_read(r->tls, buf, sizeof(buf));
+                if (n == ESP_TLS_ERR_SSL_WANT_READ)
+                {
+                    return HTTPS_WANT_READ;
+                }
+                if (n == ESP_TLS_ERR_SSL_WANT_WRITE)
+                {
+                    return HTTPS_WANT_WRITE;
+                }
+                if (n <= 0)
+                {
+                    ESP_LOGE(TAG, "https %s: connection closed early",
+                             r->host);
+                    https_finish(r, -1);
+                    return 0;
+                }
+                https_parse(r, buf, n);
+            }
+            // a redirect starts the request over at its new address
+            if (r->state == HTTPS_QUEUED)
+            {
+                return https_step(r);
+            }
+            return 0;
+        default:
+            return 0;
     }
+}
+
+// Run the requests, at most max_active at a time and in the order
+// given. Once one fails the ones not yet started are left alone, as the
+// network is most likely down. Returns how many got an HTTP status.
+int https_run(struct https_req* reqs, int count, int max_active,
+              int timeout_ms)
+{
+    https_trust();
+    int64_t deadline = esp_timer_get_time() + (int64_t)timeout_ms * 1000;
+    int next = 0;
+    int failed = 0;
+    int done = 0;
     while (1)
     {
-        err = esp_http_client_perform(client);
-        if (err != ESP_ERR_HTTP_EAGAIN)
+        int active = 0;
+        int progress = 0;
+        int max_fd = -1;
+        fd_set rfds;
+        fd_set wfds;
+        FD_ZERO(&rfds);
+        FD_ZERO(&wfds);
+        for (int i = 0; i < next; i++)
+        {
+            if (reqs[i].state != HTTPS_DONE)
+            {
+                active++;
+            }
+        }
+        while (!failed && active < max_active && next < count)
+        {
+            if (reqs[next].state == HTTPS_QUEUED)
+            {
+                active++;
+            }
+            next++;
+        }
+        for (int i = 0; i < next; i++)
+        {
+            struct https_req* r = &reqs[i];
+            if (r->state == HTTPS_DONE)
+            {
+                continue;
+            }
+            int want = https_step(r);
+            int fd = -1;
+            if (want && esp_tls_get_conn_sockfd(r->tls, &fd) != ESP_OK)
+            {
+                fd = -1;
+            }
+            if (want && fd < 0)
+            {
+                https_finish(r, -1);
+                want = 0;
+            }
+            if (!want)
+            {
+                progress = 1;
+                done += (r->status >= 0);
+                failed = failed || (r->status < 200 || r->status >= 300);
+                continue;
+            }
+            FD_SET(fd, (want == HTTPS_WANT_READ) ? &rfds : &wfds);
+            max_fd = (fd > max_fd) ? fd : max_fd;
+        }
+        if (progress)
+        {
+            // start the next ones before waiting
+            continue;
+        }
+        if (max_fd < 0)
+        {
+            break;
+        }
+        int64_t left = deadline - esp_timer_get_time();
+        if (left <= 0)
         {
+            ESP_LOGE(TAG, "https: timed out");
+            for (int i = 0; i < next; i++)
+            {
+                if (reqs[i].state != HTTPS_DONE)
+                {
+                    https_finish(&reqs[i], -1);
+                }
+            }
             break;
         }
+        struct timeval tv = {
+            .tv_sec = left / 1000000,
+            .tv_usec = left % 1000000,
+        };
+        select(max_fd + 1, &rfds, &wfds, NULL, &tv);
+    }
+    return done;
+}
+
+#if CONFIG_PLM_TLS_BENCH
+// Connect to a host a few times and log how long each TLS handshake
+// took and how far it pulled the free heap down, to compare the pinned
+// CA with the bundle. The first round includes the DNS lookup.
+void https_bench(const char* url, int rounds)
+{
+    char host[HTTPS_HOST_LEN];
+    int port;
+    if (!https_split(url, host, sizeof(host), &port))
+    {
+        return;
     }
-    if (err == ESP_OK)
+    https_trust();
+    esp_tls_cfg_t cfg = tls_cfg;
+    cfg.non_block = false;
+    cfg.timeout_ms = 10000;
+    int ok = 0;
+    int64_t total = 0;
+    int64_t worst = 0;
+    size_t peak = 0;
+    for (int i = 0; i < rounds; i++)
     {
-        ESP_LOGI(TAG, "HTTPS Status = %d, content_length = %lld",
-                 esp_http_client_get_status_code(client),
-                 esp_http_client_get_content_length(client));
+        size_t before = heap_caps_get_free_size(MALLOC_CAP_DEFAULT);
+        heap_caps_monitor_local_minimum_free_size_start();
+        int64_t start = esp_timer_get_time();
+        esp_tls_t* tls = esp_tls_init();
+        int ret = -1;
+        if (tls)
+        {
+            ret = esp_tls_conn_new_sync(host, strlen(host), port, &cfg, tls);
+        }
+        int64_t us = esp_timer_get_time() - start;
+        size_t used =
+            before - heap_caps_get_minimum_free_size(MALLOC_CAP_DEFAULT);
+        heap_caps_monitor_local_minimum_free_size_stop();
+        if (tls)
+        {
+            esp_tls_conn_destroy(tls);
+        }
+        ESP_LOGI(TAG, "tls bench %d: %s, %lld ms, peak heap %u bytes", i,
+                 (ret == 1 ? "ok" : "failed"), us / 1000, (unsigned)used);
+        if (ret != 1)
+        {
+            continue;
+        }
+        ok++;
+        total += us;
+        worst = (us > worst) ? us : worst;
+        peak = (used > peak) ? used : peak;
     }
-    else
+    ESP_LOGI(TAG,
+             "tls bench, " TRUST_NAME ": %d/%d ok, mean %lld ms, "
+             "worst %lld ms, peak heap %u bytes",
+             ok, rounds, (ok ? total / ok / 1000 : 0), worst / 1000,
+             (unsigned)peak);
+}
+#endif
+
+// a single request, for callers that have only the one
+static int https_one(const char* method, const char* url, const char* query,
+                     const char* data, const char* content_type,
+                     const char* auth)
+{
+    struct https_req r;
+    if (https_req_init(&r, method, url, query, data, content_type, auth) < 0)
     {
-        ESP_LOGE(TAG, "Error perform http request %s", esp_err_to_name(err));
+        return -1;
     }
-    esp_http_client_cleanup(client);
+    https_run(&r, 1, 1, 10000);
+    https_req_free(&r);
+    return r.status;
 }
 
-void https_get(const char* host, const char* path, const char* query)
+// returns the HTTP status, or -1 if the request failed
+int https_post(const char* uri, const char* data, const char* content_type,
+               const char* user, const char* passwd)
 {
-    printf("get: https://%s%s%s%s\n", host, path, (query ? "?" : ""),
-           (query ? query : ""));
-    esp_http_client_config_t config = {
-        .host = host,
-        .path = path,
-        .query = query,
-        .method = HTTP_METHOD_GET,
-        .common_name = host,
-        .event_handler = _http_event_handler,
-        .crt_bundle_attach = esp_crt_bundle_attach,
-    };
-    esp_http_client_handle_t client = esp_http_client_init(&config);
-    esp_err_t err = esp_http_client_perform(client);
-
-    if (err == ESP_OK)
-    {
-        ESP_LOGI(TAG, "HTTPS Status = %d, content_length = %lld",
-                 esp_http_client_get_status_code(client),
-                 esp_http_client_get_content_length(client));
+    char* auth = NULL;
+    if (user || passwd)
+    {
+        auth = basic_auth(user, passwd);
     }
-    else
+    int status = https_one("POST", uri, NULL, data, content_type, auth);
+    free(auth);
+    return status;
+}
+
+int https_get(const char* host, const char* path, const char* query)
+{
+    size_t len = strlen(host) + strlen(path) + 1;
+    char* url = malloc(len);
+    if (!url)
     {
-        ESP_LOGE(TAG, "Error perform http request %s", esp_err_to_name(err));
+        return -1;
     }
-    esp_http_client_cleanup(client);
+    snprintf(url, len, "%s%s", host, path);
+    int status = https_one("GET", url, query, NULL, NULL, NULL);
+    free(url);
+    return status;
 }
 
 char* urlencode(const char* msg)
@@ -0,0 +1,66 @@
+/* Pilot Light Monitor
+ *
+ * Copyright 2023 Vernon Mauery <vernon@mauery.org>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+#pragma once
+
+#include <esp_tls.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// An HTTPS request, driven by https_run() as a small state machine so
+// that several can be in flight at once
+
+enum https_state
+{
+    HTTPS_QUEUED,
+    HTTPS_CONNECTING,
+    HTTPS_SENDING,
+    HTTPS_RECEIVING,
+    HTTPS_DONE,
+};
+
+#define HTTPS_HOST_LEN 64
+// longest response header line kept; a longer Location isn't followed
+#define HTTPS_LINE_LEN 192
+
+struct https_req
+{
+    char host[HTTPS_HOST_LEN];
+    int port;
+    char* msg;      // request line, headers and body
+    size_t len;
+    size_t sent;
+    int status;     // HTTP status, or -1 if the request failed
+    int state;      // enum https_state
+    esp_tls_t* tls;
+    char line[HTTPS_LINE_LEN]; // the response header line coming in
+    uint8_t line_len;
+    uint8_t line_long; // it didn't fit in line
+    uint8_t lines;     // header lines seen, including the status line
+    uint8_t redirects;
+    char* location; // a redirect's Location
+    // esp_timer microseconds at each step, for the timing log
+    int64_t t_start;
+    int64_t t_tcp;
+    int64_t t_tls;
+    int64_t t_sent;
+    int64_t t_done;
+};
+
+int https_req_init(struct https_req* r, const char* method, const char* url,
+                   const char* query, const char* data,
+                   const char* content_type, const char* auth);
+void https_req_free(struct https_req* r);
+int https_run(struct https_req* reqs, int count, int max_active,
+              int timeout_ms);
+void https_bench(const char* url, int rounds);
+
+int https_get(const char* host, const char* path, const char* query);
+int https_post(const char* uri, const char* data, const char* content_type,
+               const char* user, const char* passwd);
+char* basic_auth(const char* user, const char* passwd);
+char* urlencode(const char* msg);
@@ -0,0 +1,242 @@
+/* Pilot Light Monitor
+ *
+ * Copyright 2023 Vernon Mauery <vernon@mauery.org>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+#include <esp_attr.h>
+#include <esp_log.h>
+#include <esp_random.h>
+#include <sdkconfig.h>
+#include <string.h>
+
+#include "outbox.h"
+
+extern const char* TAG;
+
+// Messages waiting for the network, kept in RTC memory so a wake that
+// can't get online doesn't lose them. Alerts are never dropped to make
+// room for anything else.
+static RTC_DATA_ATTR struct outbox_msg outbox[OUTBOX_LEN];
+// every message gets its own ID so the server can spot one it has
+// already taken; random after a cold boot so IDs aren't reused
+static RTC_DATA_ATTR uint32_t outbox_id;
+
+// retry state for getting the outbox delivered
+static RTC_DATA_ATTR int net_fails;
+static RTC_DATA_ATTR int net_retry_tick;
+static RTC_DATA_ATTR int budget_start_tick;
+static RTC_DATA_ATTR int budget_fails;
+
+// one day of 120 second ticks
+#define BUDGET_TICKS 720
+
+void outbox_init(void)
+{
+    for (int i = 0; i < OUTBOX_LEN; i++)
+    {
+        outbox[i].kind = -1;
+    }
+    outbox_id = esp_random();
+    net_fails = 0;
+    net_retry_tick = 0;
+    budget_start_tick = 0;
+    budget_fails = 0;
+}
+
+static struct outbox_msg* outbox_victim(int kind)
+{
+    // oldest telemetry goes first, then a ping; an alert can only
+    // replace another alert if the whole outbox is alerts
+    static const int order[] = {OUTBOX_TELEMETRY, OUTBOX_PING, OUTBOX_ALERT};
+    for (int o = 0; o < (int)(sizeof(order) / sizeof(order[0])); o++)
+    {
+        if (order[o] < kind)
+        {
+            break;
+        }
+        struct outbox_msg* v = NULL;
+        for (int i = 0; i < OUTBOX_LEN; i++)
+        {
+            if (outbox[i].kind == order[o] &&
+                (!v || outbox[i].queued < v->queued))
+            {
+                v = &outbox[i];
+            }
+        }
+        if (v)
+        {
+            return v;
+        }
+    }
+    return NULL;
+}
+
+// returns 1 if queued, 0 if it was a duplicate or had no room
+int outbox_push(int kind, time_t now, const char* text)
+{
+    struct outbox_msg* m = NULL;
+    for (int i = 0; i < OUTBOX_LEN; i++)
+    {
+        if (outbox[i].kind == kind &&
+            (kind == OUTBOX_PING ||
+             (kind == OUTBOX_ALERT && !strcmp(outbox[i].text, text))))
+        {
+            // only one ping is ever needed and a repeated alert says
+            // nothing new
+            return 0;
+        }
+        if (!m && outbox[i].kind < 0)
+        {
+            m = &outbox[i];
+        }
+    }
+    if (!m)
+    {
+        m = outbox_victim(kind);
+        if (!m)
+        {
+            return 0;
+        }
+        ESP_LOGW(TAG, "outbox full, dropping: %s", m->text);
+    }
+    m->kind = kind;
+    m->id = outbox_id++;
+    m->queued = now;
+    strncpy(m->text, text ? text : "", sizeof(m->text) - 1);
+    m->text[sizeof(m->text) - 1] = 0;
+    return 1;
+}
+
+// highest priority, then oldest, message; NULL if the outbox is empty
+struct outbox_msg* outbox_next(void)
+{
+    struct outbox_msg* n = NULL;
+    for (int i = 0; i < OUTBOX_LEN; i++)
+    {
+        if (outbox[i].kind < 0)
+        {
+            continue;
+        }
+        if (!n || outbox[i].kind < n->kind ||
+            (outbox[i].kind == n->kind && outbox[i].queued < n->queued))
+        {
+            n = &outbox[i];
+        }
+    }
+    return n;
+}
+
+// Everything in the outbox in the order it should go out; returns how
+// many were put in list
+int outbox_list(struct outbox_msg** list, int max)
+{
+    int n = 0;
+    for (int i = 0; i < OUTBOX_LEN && n < max; i++)
+    {
+        struct outbox_msg* m = &outbox[i];
+        if (m->kind < 0)
+        {
+            continue;
+        }
+        int j = n++;
+        for (; j > 0 && (list[j - 1]->kind > m->kind ||
+                         (list[j - 1]->kind == m->kind &&
+                          list[j - 1]->queued > m->queued));
+             j--)
+        {
+            list[j] = list[j - 1];
+        }
+        list[j] = m;
+    }
+    return n;
+}
+
+void outbox_drop(struct outbox_msg* m)
+{
+    m->kind = -1;
+}
+
+int outbox_count(int kind)
+{
+    int c = 0;
+    for (int i = 0; i < OUTBOX_LEN; i++)
+    {
+        c += (outbox[i].kind == kind);
+    }
+    return c;
+}
+
+// Should this wake bring up the network? Report ticks and pending alerts
+// want it, but after a failure we back off (1, 2, 4... ticks, never
+// longer than a report interval), and once the day's budget of failed
+// attempts is spent, retries wait for the next report tick.
+int outbox_attempt_due(int tick, int report_tick, int report_interval)
+{
+    if (tick - budget_start_tick >= BUDGET_TICKS)
+    {
+        budget_start_tick = tick;
+        budget_fails = 0;
+    }
+    if (!report_tick && !outbox_next())
+    {
+        return 0;
+    }
+    if (net_fails && tick < net_retry_tick)
+    {
+        ESP_LOGI(TAG, "network backoff: %d ticks to go", net_retry_tick - tick);
+        return 0;
+    }
+    if (!report_tick && budget_fails >= CONFIG_PLM_NET_RETRY_BUDGET)
+    {
+        ESP_LOGI(TAG, "network retry budget spent");
+        return 0;
+    }
+    return 1;
+}
+
+// The first tick after this one where outbox_attempt_due might say yes,
+// so the wake stub knows which ticks it can handle by itself
+int outbox_next_attempt(int tick, int report_interval)
+{
+    int next = (tick / report_interval + 1) * report_interval;
+    if (!outbox_next())
+    {
+        return next;
+    }
+    int retry = tick + 1;
+    if (budget_fails >= CONFIG_PLM_NET_RETRY_BUDGET)
+    {
+        retry = budget_start_tick + BUDGET_TICKS;
+    }
+    else if (net_fails && net_retry_tick > retry)
+    {
+        retry = net_retry_tick;
+    }
+    return retry < next ? retry : next;
+}
+
+// did the last attempt to reach the network fail?
+int outbox_net_failing(void)
+{
+    return net_fails > 0;
+}
+
+void outbox_attempt_done(int tick, int ok, int report_interval)
+{
+    if (ok)
+    {
+        net_fails = 0;
+        return;
+    }
+    budget_fails++;
+    int backoff = 1 << (net_fails < 8 ? net_fails : 8);
+    if (backoff > report_interval)
+    {
+        backoff = report_interval;
+    }
+    net_fails++;
+    net_retry_tick = tick + backoff;
+}
@@ -0,0 +1,42 @@
+/* Pilot Light Monitor
+ *
+ * Copyright 2023 Vernon Mauery <vernon@mauery.org>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+
+// in the order they are sent
+enum outbox_kind
+{
+    OUTBOX_ALERT,
+    OUTBOX_PING,
+    OUTBOX_TELEMETRY,
+};
+
+#define OUTBOX_LEN 6
+#define OUTBOX_MSG_LEN 192
+
+struct outbox_msg
+{
+    int kind;       // enum outbox_kind, -1 for a free slot
+    uint32_t id;
+    time_t queued;  // RTC seconds when it was queued
+    char text[OUTBOX_MSG_LEN];
+};
+
+void outbox_init(void);
+int outbox_push(int kind, time_t now, const char* text);
+struct outbox_msg* outbox_next(void);
+int outbox_list(struct outbox_msg** list, int max);
+void outbox_drop(struct outbox_msg* m);
+int outbox_count(int kind);
+
+int outbox_attempt_due(int tick, int report_tick, int report_interval);
+int outbox_next_attempt(int tick, int report_interval);
+void outbox_attempt_done(int tick, int ok, int report_interval);
+int outbox_net_failing(void);
@@ -13,25 +13,44 @@
 #include <esp_adc/adc_cali.h>
 #include <esp_adc/adc_cali_scheme.h>
 #include <esp_adc/adc_oneshot.h>
+#include <esp_efuse_rtc_calib.h>
 #include <esp_event.h>
 #include <esp_log.h>
+#include <esp_mac.h>
 #include <esp_pm.h>
+#include <esp_rom_regi2c.h>
 #include <esp_sleep.h>
+#include <esp_timer.h>
+#include <esp_wake_stub.h>
 #include <esp_wifi.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/event_groups.h>
 #include <freertos/task.h>
+#include <hal/regi2c_ctrl_ll.h>
 #include <nvs_flash.h>
 #include <sdkconfig.h>
+#include <soc/apb_saradc_reg.h>
+#include <soc/regi2c_saradc.h>
 #include <soc/rtc.h>
+#include <soc/rtc_cntl_reg.h>
 #include <soc/soc_caps.h>
+#include <soc/system_reg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
 #include <time.h>
 
+#include "capture.h"
+#include "coap.h"
+#include "cusum.h"
+#include "devkey.h"
+#include "filter.h"
+#include "https.h"
 #include "nanoprintf.h"
+#include "outbox.h"
+#include "sim.h"
+#include "tlog.h"
 
 const char* TAG = "pilot-light-monitor";
 
@@ -49,19 +68,72 @@ const char* TAG = "pilot-light-monitor";
 #define DEFAULT_PS_MODE WIFI_PS_NONE
 #endif
 
-static const char alert_num[] = CONFIG_PLM_TWILIO_SMS_ALERT;
 #define UPTIME_HOST CONFIG_PLM_UPTIME_HOST
+#define LOG_PATH "/uptime/log/"
+// a log line and a watchdog ping in one request
+#define REPORT_PATH "/uptime/report/" CONFIG_PLM_WATCHDOG_NAME
+// texted by the server to the watchdog's number
+#define ALERT_PATH "/uptime/alert/" CONFIG_PLM_WATCHDOG_NAME
+
+#if CONFIG_PLM_QEMU
+// QEMU has no Wi-Fi; its emulated Ethernet stands in
+#define GOT_IP_EVENT IP_EVENT_ETH_GOT_IP
+#else
+#define GOT_IP_EVENT IP_EVENT_STA_GOT_IP
+#endif
+
+void led_codes_stop(void);
 
-void https_get(const char* host, const char* path, const char* query);
-void https_post(const char* uri, const char* data, const char* type,
-                const char* user, const char* passwd);
-char* urlencode(const char* msg);
+static inline int http_ok(int status)
+{
+    return status >= 200 && status < 300;
+}
 
-void ulog(const char* msg)
+// stable per-board ID (the factory MAC) so the server can keep
+// each monitor's log separate
+const char* device_id(void)
 {
-    char* smsg = urlencode(msg);
-    https_get(UPTIME_HOST, "/uptime/log/", smsg);
+    static char id[13];
+    if (!id[0])
+    {
+        uint8_t mac[6];
+        ESP_ERROR_CHECK(esp_efuse_mac_get_default(mac));
+        snprintf(id, sizeof(id), "%02x%02x%02x%02x%02x%02x", mac[0], mac[1],
+                 mac[2], mac[3], mac[4], mac[5]);
+    }
+    return id;
+}
+
+// a log line for the uptime host; msg may be NULL for a bare report.
+// coap, if not 0, is the counter of a CoAP datagram that carried the
+// same line but wasn't acked, so the server can tell if it got there.
+static int ulog_req(struct https_req* r, const char* path, const char* msg,
+                    uint64_t coap)
+{
+    char* smsg = urlencode(msg ? msg : "");
+    if (!smsg)
+    {
+        return -1;
+    }
+    int ret = -1;
+    size_t qlen = strlen(smsg) + 64;
+    char* q = malloc(qlen);
+    if (q)
+    {
+        int n = snprintf(q, qlen, "dev=%s", device_id());
+        if (coap)
+        {
+            n += snprintf(q + n, qlen - n, "&coap=%llu",
+                          (unsigned long long)coap);
+        }
+        snprintf(q + n, qlen - n, "%s%s", (msg ? "&" : ""), smsg);
+        char url[sizeof(UPTIME_HOST) + sizeof(REPORT_PATH) + 1];
+        snprintf(url, sizeof(url), "%s%s", UPTIME_HOST, path);
+        ret = https_req_init(r, "GET", url, q, NULL, NULL, NULL);
+        free(q);
+    }
     free(smsg);
+    return ret;
 }
 
 void light_usleep(uint64_t us)
@@ -76,6 +148,12 @@ void deep_usleep(uint64_t us)
     ESP_LOGI(TAG, "Enabling timer wakeup, %dus\n", (int)(us / 1000000));
     ESP_ERROR_CHECK(esp_sleep_enable_timer_wakeup(us));
 
+    // blink codes only play while there is work to do
+    led_codes_stop();
+#if CONFIG_PLM_QEMU
+    // QEMU can't deep sleep; skip ahead to the next wake
+    sim_sleep(us);
+#endif
     ESP_LOGI(TAG, "Entering deep sleep\n");
     uart_wait_tx_idle_polling(CONFIG_ESP_CONSOLE_UART_NUM);
 
@@ -85,32 +163,85 @@ void deep_usleep(uint64_t us)
 #define RED_LED GPIO_NUM_6
 #define GREEN_LED GPIO_NUM_7
 
-#define FIXED_POINT 1024
-struct windowed_ave
-{
-    int value;
-    int window;
-};
-
 static RTC_DATA_ATTR int sleep_count;
 
 static RTC_DATA_ATTR int low_bat_count;
-static RTC_DATA_ATTR struct windowed_ave batt_v_ave;
+static RTC_DATA_ATTR struct wmean batt_v_ave;
 
 static RTC_DATA_ATTR int pilot_light_out;
-static RTC_DATA_ATTR struct windowed_ave flame_v_ave;
+static RTC_DATA_ATTR struct ema flame_v_ave;
+static RTC_DATA_ATTR struct cusum flame_cusum;
 
 static RTC_DATA_ATTR int wake_count;
 
-void RTC_IRAM_ATTR esp_wake_deep_sleep(void)
+/*---------------------------------------------------------------
+        Lazy subsystem bring-up
+---------------------------------------------------------------*/
+// Each subsystem is brought up the first time a wake needs it, so quiet
+// ticks never pay for the network stack or an LED they don't light. The
+// time spent on each is logged before going back to sleep.
+enum subsys
 {
-    esp_default_wake_deep_sleep();
-    static RTC_RODATA_ATTR const char fmt_str[] = "Wake count %d\n";
-    esp_rom_printf(fmt_str, wake_count++);
+    SUBSYS_LED,
+    SUBSYS_LEDC,
+    SUBSYS_ADC,
+    SUBSYS_ADC_CHAN,
+    SUBSYS_ADC_CALI,
+    SUBSYS_NVS,
+    SUBSYS_PM,
+    SUBSYS_NETIF,
+    SUBSYS_WIFI,
+    SUBSYS_MAX,
+};
+
+static const char* const subsys_name[SUBSYS_MAX] = {
+    [SUBSYS_LED] = "led",       [SUBSYS_LEDC] = "ledc",
+    [SUBSYS_ADC] = "adc",       [SUBSYS_ADC_CHAN] = "adc_chan",
+    [SUBSYS_ADC_CALI] = "cali", [SUBSYS_NVS] = "nvs",
+    [SUBSYS_PM] = "pm",         [SUBSYS_NETIF] = "netif",
+    [SUBSYS_WIFI] = "wifi",
+};
+
+static uint32_t subsys_ready;
+static uint32_t subsys_us[SUBSYS_MAX];
+
+static inline int subsys_is_up(int s)
+{
+    return subsys_ready & (1u << s);
+}
+
+// mark a subsystem up and charge it the time since start
+static void subsys_done(int s, int64_t start)
+{
+    subsys_ready |= 1u << s;
+    subsys_us[s] += esp_timer_get_time() - start;
+}
+
+static void subsys_down(int s)
+{
+    subsys_ready &= ~(1u << s);
+}
+
+static void subsys_log(void)
+{
+    char line[160];
+    int len = 0;
+    for (int s = 0; s < SUBSYS_MAX; s++)
+    {
+        if (subsys_us[s] && len < sizeof(line))
+        {
+            len += snprintf(line + len, sizeof(line) - len, " %s=%lu",
+                            subsys_name[s], (unsigned long)subsys_us[s]);
+        }
+    }
+    ESP_LOGI(TAG, "awake %lldus, init us:%s", esp_timer_get_time(),
+             len ? line : " none");
 }
 
 static TaskHandle_t xMainTask = NULL;
 const UBaseType_t xEthReadyIndex = 0;
+// capture_flame's sample timer
+static const UBaseType_t xCaptureIndex = 1;
 
 static void event_handler(void* arg, esp_event_base_t event_base,
                           int32_t event_id, void* event_data)
@@ -124,7 +255,7 @@ static void event_handler(void* arg, esp_event_base_t event_base,
     {
         esp_wifi_connect();
     }
-    else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP)
+    else if (event_base == IP_EVENT && event_id == GOT_IP_EVENT)
     {
         ip_event_got_ip_t* event = (ip_event_got_ip_t*)event_data;
         ESP_LOGI(TAG, "got ip: " IPSTR, IP2STR(&event->ip_info.ip));
@@ -135,15 +266,35 @@ static void event_handler(void* arg, esp_event_base_t event_base,
 
 static void wifi_shutdown(void)
 {
-    esp_wifi_stop();
-    esp_wifi_deinit();
-    esp_event_loop_delete_default();
-    nvs_flash_deinit();
+    if (subsys_is_up(SUBSYS_WIFI))
+    {
+#if CONFIG_PLM_QEMU
+        sim_net_down();
+#else
+        esp_wifi_stop();
+        esp_wifi_deinit();
+#endif
+        subsys_down(SUBSYS_WIFI);
+    }
+    if (subsys_is_up(SUBSYS_NETIF))
+    {
+        esp_event_loop_delete_default();
+        subsys_down(SUBSYS_NETIF);
+    }
+    if (subsys_is_up(SUBSYS_NVS))
+    {
+        nvs_flash_deinit();
+        subsys_down(SUBSYS_NVS);
+    }
 }
 
-#define ENABLE_PM 1
-static void init_wifi_power_save(void)
+static void nvs_up(void)
 {
+    if (subsys_is_up(SUBSYS_NVS))
+    {
+        return;
+    }
+    int64_t start = esp_timer_get_time();
     // Initialize NVS
     esp_err_t ret = nvs_flash_init();
     if (ret == ESP_ERR_NVS_NO_FREE_PAGES ||
@@ -153,10 +304,17 @@ static void init_wifi_power_save(void)
         ret = nvs_flash_init();
     }
     ESP_ERROR_CHECK(ret);
-    // Configure dynamic frequency scaling:
-    // maximum and minimum frequencies are set in sdkconfig,
-    // automatic light sleep is enabled if tickless idle support is enabled.
+    subsys_done(SUBSYS_NVS, start);
+}
 
+#define ENABLE_PM 1
+static void pm_up(void)
+{
+    if (subsys_is_up(SUBSYS_PM))
+    {
+        return;
+    }
+    int64_t start = esp_timer_get_time();
 #if CONFIG_PM_ENABLE
     // Configure dynamic frequency scaling:
     // maximum and minimum frequencies are set in sdkconfig,
@@ -181,20 +339,54 @@ static void init_wifi_power_save(void)
     printf("enabling power management\n");
     ESP_ERROR_CHECK(esp_pm_configure(&pm_config));
 #endif // CONFIG_PM_ENABLE
+    // the configuration sticks for the rest of the wake
+    subsys_done(SUBSYS_PM, start);
+}
 
-    // init wifi as sta and set power save mode
-    ESP_ERROR_CHECK(esp_netif_init());
+static void netif_up(void)
+{
+    if (subsys_is_up(SUBSYS_NETIF))
+    {
+        return;
+    }
+    int64_t start = esp_timer_get_time();
+    // esp_netif_init and the sta netif only ever happen once per boot
+    static int netif_init_done = 0;
+    if (!netif_init_done)
+    {
+        ESP_ERROR_CHECK(esp_netif_init());
+        netif_init_done = 1;
+    }
     ESP_ERROR_CHECK(esp_event_loop_create_default());
-    esp_netif_t* sta_netif = esp_netif_create_default_wifi_sta();
-    assert(sta_netif);
-
-    wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
-    ESP_ERROR_CHECK(esp_wifi_init(&cfg));
-
+#if !CONFIG_PLM_QEMU
+    // (the emulated Ethernet's netif comes and goes with it)
+    static esp_netif_t* sta_netif = NULL;
+    if (!sta_netif)
+    {
+        sta_netif = esp_netif_create_default_wifi_sta();
+        assert(sta_netif);
+    }
+#endif
     ESP_ERROR_CHECK(esp_event_handler_instance_register(
         WIFI_EVENT, ESP_EVENT_ANY_ID, &event_handler, NULL, NULL));
     ESP_ERROR_CHECK(esp_event_handler_instance_register(
-        IP_EVENT, IP_EVENT_STA_GOT_IP, &event_handler, NULL, NULL));
+        IP_EVENT, GOT_IP_EVENT, &event_handler, NULL, NULL));
+    subsys_done(SUBSYS_NETIF, start);
+}
+
+static void wifi_up(void)
+{
+    if (subsys_is_up(SUBSYS_WIFI))
+    {
+        return;
+    }
+    int64_t start = esp_timer_get_time();
+#if CONFIG_PLM_QEMU
+    sim_net_up();
+#else
+    // init wifi as sta and set power save mode
+    wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
+    ESP_ERROR_CHECK(esp_wifi_init(&cfg));
 
     wifi_config_t wifi_config = {
         .sta =
@@ -210,6 +402,17 @@ static void init_wifi_power_save(void)
 
     ESP_LOGI(TAG, "esp_wifi_set_ps().");
     esp_wifi_set_ps(DEFAULT_PS_MODE);
+#endif
+    subsys_done(SUBSYS_WIFI, start);
+}
+
+// everything a request needs, in the order it needs it
+static void init_wifi_power_save(void)
+{
+    nvs_up();
+    pm_up();
+    netif_up();
+    wifi_up();
 }
 
 /*---------------------------------------------------------------
@@ -273,32 +476,44 @@ struct adc_conf
 {
     adc_oneshot_unit_handle_t unit;
     adc_cali_handle_t cal;
+    uint32_t chans; // channels configured so far
 };
 
 void __init_adc(struct adc_conf* adc)
 {
     //-------------ADC1 Init---------------//
+    int64_t start = esp_timer_get_time();
     adc_oneshot_unit_init_cfg_t init_config1 = {
         .unit_id = ADC_UNIT_1,
     };
     ESP_ERROR_CHECK(adc_oneshot_new_unit(&init_config1, &adc->unit));
-
-    //-------------ADC1 Config---------------//
-    adc_oneshot_chan_cfg_t config = {
-        .bitwidth = ADC_BITWIDTH_DEFAULT,
-        .atten = PLM_ADC_ATTEN,
-    };
-    ESP_ERROR_CHECK(
-        adc_oneshot_config_channel(adc->unit, PLM_ADC1_CHAN0, &config));
-    ESP_ERROR_CHECK(
-        adc_oneshot_config_channel(adc->unit, PLM_ADC1_CHAN1, &config));
+    subsys_done(SUBSYS_ADC, start);
 
     //-------------ADC1 Calibration Init---------------//
+    start = esp_timer_get_time();
     adc->cal = NULL;
     if (!plm_adc_calibration_init(ADC_UNIT_1, PLM_ADC_ATTEN, &adc->cal))
     {
         adc->cal = NULL;
     }
+    subsys_done(SUBSYS_ADC_CALI, start);
+}
+
+// channels are configured the first time they are read
+static void __init_adc_chan(struct adc_conf* adc, adc_channel_t chan)
+{
+    if (adc->chans & (1u << chan))
+    {
+        return;
+    }
+    int64_t start = esp_timer_get_time();
+    adc_oneshot_chan_cfg_t config = {
+        .bitwidth = ADC_BITWIDTH_DEFAULT,
+        .atten = PLM_ADC_ATTEN,
+    };
+    ESP_ERROR_CHECK(adc_oneshot_config_channel(adc->unit, chan, &config));
+    adc->chans |= 1u << chan;
+    subsys_done(SUBSYS_ADC_CHAN, start);
 }
 
 void __fini_adc(struct adc_conf* adc)
@@ -309,15 +524,25 @@ void __fini_adc(struct adc_conf* adc)
     {
         plm_adc_calibration_deinit(adc->cal);
     }
+    subsys_down(SUBSYS_ADC);
+    subsys_down(SUBSYS_ADC_CHAN);
+    subsys_down(SUBSYS_ADC_CALI);
 }
 
+// set up by read_adc, which also does the teardown
+static struct adc_conf* adc = NULL;
+
 void read_adc(int reps, int light_sleep, int* ch0, int* ch1)
 {
-    static struct adc_conf* adc = NULL;
     int i;
     int v0 = 0;
     int v1 = 0;
 
+#if CONFIG_PLM_QEMU
+    // QEMU has no SAR ADC; the readings come from the trace
+    sim_read_adc(reps, ch0, ch1);
+    return;
+#endif
     if (!adc && (ch0 || ch1))
     {
         adc = malloc(sizeof(*adc));
@@ -330,6 +555,14 @@ void read_adc(int reps, int light_sleep, int* ch0, int* ch1)
         free(adc);
         adc = NULL;
     }
+    if (ch0)
+    {
+        __init_adc_chan(adc, PLM_ADC1_CHAN0);
+    }
+    if (ch1)
+    {
+        __init_adc_chan(adc, PLM_ADC1_CHAN1);
+    }
 
     for (i = 0; i < reps; i++)
     {
@@ -405,6 +638,68 @@ void read_adc(int reps, int light_sleep, int* ch0, int* ch1)
     }
 }
 
+#if CONFIG_PLM_CAPTURE
+static void capture_tick(void* arg)
+{
+    xTaskNotifyGiveIndexed(xMainTask, xCaptureIndex);
+}
+
+// Record the flame channel at CONFIG_PLM_CAPTURE_HZ, one sample per
+// period with none of read_adc's averaging or sleeps, to see how a
+// transition plays out. The ADC must already be set up by read_adc.
+// The task sleeps between samples; a periodic timer wakes it for each.
+static void capture_flame(time_t now, int reason)
+{
+    const int period_us = 1000000 / CONFIG_PLM_CAPTURE_HZ;
+    const int samples = CONFIG_PLM_CAPTURE_MS * CONFIG_PLM_CAPTURE_HZ / 1000;
+    const esp_timer_create_args_t args = {
+        .callback = capture_tick,
+        .name = "capture",
+    };
+    esp_timer_handle_t timer;
+    if (esp_timer_create(&args, &timer) != ESP_OK)
+    {
+        return;
+    }
+    capture_begin(now, reason, CONFIG_PLM_CAPTURE_HZ);
+    ESP_ERROR_CHECK(esp_timer_start_periodic(timer, period_us));
+    for (int i = 0; i < samples; i++)
+    {
+        // a late wake still takes one sample per period, so sample i
+        // stays at i periods in
+        if (i > 0 &&
+            ulTaskNotifyTakeIndexed(xCaptureIndex, pdFALSE,
+                                    pdMS_TO_TICKS(100)) == 0)
+        {
+            break;
+        }
+        int voltage;
+#if CONFIG_PLM_QEMU
+        voltage = sim_flame_mv();
+#else
+        int adc_raw;
+        if (adc_oneshot_read(adc->unit, PLM_ADC1_CHAN0, &adc_raw) != ESP_OK)
+        {
+            break;
+        }
+        voltage = adc_raw;
+        if (adc->cal)
+        {
+            adc_cali_raw_to_voltage(adc->cal, adc_raw, &voltage);
+        }
+#endif
+        if (!capture_add(voltage))
+        {
+            break;
+        }
+    }
+    esp_timer_stop(timer);
+    esp_timer_delete(timer);
+    ulTaskNotifyTakeIndexed(xCaptureIndex, pdTRUE, 0);
+    capture_end();
+}
+#endif
+
 void init_led(int led)
 {
     gpio_reset_pin(led);
@@ -412,8 +707,18 @@ void init_led(int led)
     gpio_set_direction(led, GPIO_MODE_OUTPUT);
 }
 
+// LEDs driven as plain GPIOs this wake
+static uint32_t led_ready;
+
 void set_led(int led, int val)
 {
+    if (!(led_ready & (1u << led)))
+    {
+        int64_t start = esp_timer_get_time();
+        init_led(led);
+        led_ready |= 1u << led;
+        subsys_done(SUBSYS_LED, start);
+    }
     gpio_set_level(led, val);
     return;
     switch (led)
@@ -427,19 +732,132 @@ void set_led(int led, int val)
     }
 }
 
+// Blink codes play from an esp_timer alongside the rest of the wake
+// instead of holding it up; one slot per LED.
+#define LED_CODE_BIT_US (250 * 1000)
+#define LED_CODE_SLOTS 2
+
+struct led_code_slot
+{
+    int led;
+    uint32_t bits;
+};
+
+static struct led_code_slot led_codes[LED_CODE_SLOTS] = {
+    {.led = -1},
+    {.led = -1},
+};
+static esp_timer_handle_t led_code_timer;
+static portMUX_TYPE led_code_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static void led_code_step(void* arg)
+{
+    int playing = 0;
+    taskENTER_CRITICAL(&led_code_lock);
+    for (int i = 0; i < LED_CODE_SLOTS; i++)
+    {
+        struct led_code_slot* c = &led_codes[i];
+        if (c->led < 0)
+        {
+            continue;
+        }
+        gpio_set_level(c->led, c->bits & 1);
+        if (c->bits)
+        {
+            c->bits >>= 1;
+            playing = 1;
+        }
+        else
+        {
+            // that was the trailing off
+            c->led = -1;
+        }
+    }
+    taskEXIT_CRITICAL(&led_code_lock);
+    if (!playing)
+    {
+        esp_timer_stop(led_code_timer);
+    }
+}
+
 void led_code(int led, uint32_t c)
 {
     // each bit is 1/4 second - each code up to 8 seconds
     // 0 is off, 1 is on, start from LSB
-    // if all remaining bits are 0, exit
-    while (c)
+    // when all remaining bits are 0, the LED goes off
+    set_led(led, c & 1);
+    if (!led_code_timer)
+    {
+        const esp_timer_create_args_t args = {
+            .callback = led_code_step,
+            .name = "led_code",
+        };
+        ESP_ERROR_CHECK(esp_timer_create(&args, &led_code_timer));
+    }
+    taskENTER_CRITICAL(&led_code_lock);
+    struct led_code_slot* slot = NULL;
+    for (int i = 0; i < LED_CODE_SLOTS; i++)
+    {
+        if (led_codes[i].led == led || (!slot && led_codes[i].led < 0))
+        {
+            slot = &led_codes[i];
+        }
+    }
+    if (slot)
+    {
+        slot->led = led;
+        slot->bits = c >> 1;
+    }
+    taskEXIT_CRITICAL(&led_code_lock);
+    if (!esp_timer_is_active(led_code_timer))
+    {
+        esp_timer_start_periodic(led_code_timer, LED_CODE_BIT_US);
+    }
+}
+
+int led_code_playing(int led)
+{
+    int playing = 0;
+    taskENTER_CRITICAL(&led_code_lock);
+    for (int i = 0; i < LED_CODE_SLOTS; i++)
+    {
+        playing = playing || (led_codes[i].led == led);
+    }
+    taskEXIT_CRITICAL(&led_code_lock);
+    return playing;
+}
+
+// cut short any code playing on led, leaving it off
+void led_code_stop(int led)
+{
+    taskENTER_CRITICAL(&led_code_lock);
+    for (int i = 0; i < LED_CODE_SLOTS; i++)
+    {
+        if (led_codes[i].led == led)
+        {
+            led_codes[i].led = -1;
+        }
+    }
+    taskEXIT_CRITICAL(&led_code_lock);
+    if (led_ready & (1u << led))
+    {
+        gpio_set_level(led, 0);
+    }
+}
+
+void led_codes_stop(void)
+{
+    if (led_code_timer)
+    {
+        esp_timer_stop(led_code_timer);
+    }
+    for (int i = 0; i < LED_CODE_SLOTS; i++)
     {
-        int b = c & 1;
-        c >>= 1;
-        set_led(led, b);
-        light_usleep(249 * 1000);
+        if (led_codes[i].led >= 0)
+        {
+            led_code_stop(led_codes[i].led);
+        }
     }
-    set_led(led, 0);
 }
 
 #define TIMER_WAKEUP_TIME_US (5 * 1000 * 1000)
@@ -453,88 +871,233 @@ void register_timer_wakeup(void)
     ESP_LOGI(TAG, "timer wakeup source is ready");
 }
 
-void windowed_ave_init(struct windowed_ave* a, int window)
+// An alert for the uptime host to text out. The message ID lets it
+// drop a resend of one it already has. Anyone could ask the host to
+// text the watchdog's number, so alerts are signed with the device key:
+// mac is the hex HMAC of "<device>\n<watchdog>\n<id>\n<message>".
+static int alert_req(struct https_req* r, const struct outbox_msg* m)
 {
-    a->value = -1;
-    a->window = window;
+    uint8_t key[DEVKEY_MAX];
+    int key_len = devkey_get(key);
+    if (key_len < 0)
+    {
+        return -1;
+    }
+    char head[sizeof(CONFIG_PLM_WATCHDOG_NAME) + 32];
+    int head_len = snprintf(head, sizeof(head), "%s\n%s\n%lu\n", device_id(),
+                            CONFIG_PLM_WATCHDOG_NAME, (unsigned long)m->id);
+    if (head_len < 0 || head_len >= (int)sizeof(head))
+    {
+        return -1;
+    }
+    uint8_t mac[DEVKEY_MAC_LEN];
+    devkey_mac(key, key_len, (const uint8_t*)head, head_len,
+               (const uint8_t*)m->text, strlen(m->text), mac);
+    char mac_hex[2 * DEVKEY_MAC_LEN + 1];
+    for (int i = 0; i < DEVKEY_MAC_LEN; i++)
+    {
+        snprintf(mac_hex + 2 * i, 3, "%02x", mac[i]);
+    }
+
+    char* smsg = urlencode(m->text);
+    if (!smsg)
+    {
+        return -1;
+    }
+    int ret = -1;
+    size_t datalen = strlen(smsg) + sizeof(mac_hex) + 40;
+    char* data = malloc(datalen);
+    if (data)
+    {
+        snprintf(data, datalen, "id=%lu&msg=%s&mac=%s", (unsigned long)m->id,
+                 smsg, mac_hex);
+        char q[32];
+        snprintf(q, sizeof(q), "dev=%s", device_id());
+        ret = https_req_init(r, "POST", UPTIME_HOST ALERT_PATH, q, data,
+                             "application/x-www-form-urlencoded", NULL);
+    }
+    free(smsg);
+    free(data);
+    return ret;
 }
 
-void ave_new_value(struct windowed_ave* a, int val)
+// The line a report carries: a telemetry record, with its age if it was
+// held up, or NULL for a bare ping
+static const char* report_line(char* line, size_t size,
+                               const struct outbox_msg* m, time_t now)
 {
-    val *= FIXED_POINT;
-    if (a->value == -1)
+    if (m->kind != OUTBOX_TELEMETRY)
     {
-        a->value = val;
+        return NULL;
+    }
+    // the server stamps records when they arrive; tell it how old a
+    // delayed one is
+    int age = now - m->queued;
+    if (age > 60)
+    {
+        snprintf(line, size, "%s, age=%d", m->text, age);
     }
     else
     {
-        a->value = ((a->window - 1) * a->value + val) / a->window;
+        snprintf(line, size, "%s", m->text);
     }
-}
-// return the closest integer to the average
-int ave_val(struct windowed_ave* a)
-{
-    // integer rounding to nearest value
-    return (a->value + FIXED_POINT / 2) / FIXED_POINT;
-}
-// return the whole part of the average
-static inline int ave_whole(struct windowed_ave* a)
-{
-    // integer division with truncation
-    return a->value / FIXED_POINT;
-}
-static inline int ave_millis(struct windowed_ave* a)
-{
-    // integer rounding to nearest value
-    return (1000 * (a->value % FIXED_POINT)) / FIXED_POINT;
+    return line;
 }
 
-void send_sms(const char* to, const char* msg)
+// Send what is in the outbox, most important first. Two requests go at
+// once, so an alert doesn't wait on the telemetry (or the other way
+// around). A ping rides along with the newest telemetry line as a
+// single report. Once one fails the rest are left for a later wake.
+//
+// With PLM_COAP the reports go as datagrams. The alerts go over HTTPS
+// first, so none of them waits on a CoAP ack timeout, and the first
+// report that isn't acked turns CoAP off for the rest of the wake; it
+// and the reports after it go over HTTPS. Returns 1 if the outbox was
+// emptied.
+int outbox_send(time_t now)
 {
-    if (!to || !msg)
+    struct outbox_msg* list[OUTBOX_LEN];
+    int count = outbox_list(list, OUTBOX_LEN);
+    if (!count)
     {
-        return;
+        return 1;
     }
-    const char sms_from[] = CONFIG_PLM_TWILIO_SMS_SENDER;
-    char* smsg = urlencode(msg);
-    const char MSG_FMT[] = "To=%s&From=%s&Body=%s";
-    size_t datalen = sizeof(MSG_FMT) + strnlen(smsg, 320) + sizeof(sms_from) +
-                     strnlen(to, 16) + 1;
-    char* data = malloc(datalen);
-    if (!data)
+    struct https_req* reqs = calloc(count, sizeof(*reqs));
+    if (!reqs)
     {
-        return;
+        return 0;
     }
-    const char* user = CONFIG_PLM_TWILIO_SID;
-    const char* passwd = CONFIG_PLM_TWILIO_TOKEN;
-    snprintf(data, datalen - 1, MSG_FMT, to, sms_from, smsg);
-    free(smsg);
-    https_post(
-        "https://api.twilio.com/2010-04-01/Accounts/" CONFIG_PLM_TWILIO_SID
-        "/Messages.json",
-        data, "application/x-www-form-urlencoded", user, passwd);
-    free(data);
+    // the list is oldest first within a kind, and alerts come first
+    int alerts = 0;
+    int ping = -1;
+    int report = -1;
+    for (int i = 0; i < count; i++)
+    {
+        // not started, so left in the outbox, unless it is built below
+        reqs[i].status = -1;
+        reqs[i].state = HTTPS_DONE;
+        if (list[i]->kind == OUTBOX_ALERT)
+        {
+            alerts++;
+        }
+        else if (list[i]->kind == OUTBOX_PING)
+        {
+            ping = i;
+        }
+        else if (list[i]->kind == OUTBOX_TELEMETRY)
+        {
+            report = i;
+        }
+    }
+    if (ping < 0)
+    {
+        report = -1;
+    }
+    for (int i = 0; i < alerts; i++)
+    {
+        alert_req(&reqs[i], list[i]);
+    }
+    int first = 0;
+    int sent = 1;
+#if CONFIG_PLM_COAP
+    https_run(reqs, alerts, 2, 15000);
+    for (int i = 0; i < alerts; i++)
+    {
+        sent = sent && http_ok(reqs[i].status);
+    }
+    first = alerts;
+    int coap_up = 1;
+#endif
+    for (int i = alerts; i < count && sent; i++)
+    {
+        struct outbox_msg* m = list[i];
+        if (m->kind == OUTBOX_PING && report >= 0)
+        {
+            // goes with the report
+            continue;
+        }
+        char line[OUTBOX_MSG_LEN + 24];
+        const char* text = report_line(line, sizeof(line), m, now);
+        const char* path = (m->kind == OUTBOX_PING || i == report)
+                               ? REPORT_PATH
+                               : LOG_PATH;
+        uint64_t coap = 0;
+#if CONFIG_PLM_COAP
+        if (coap_up && coap_send(path, text, &coap) == 0)
+        {
+            // already delivered; there is nothing for https_run to start
+            reqs[i].status = 204;
+            continue;
+        }
+        coap_up = 0;
+#endif
+        if (ulog_req(&reqs[i], path, text, coap) < 0)
+        {
+            reqs[i].status = -1;
+            reqs[i].state = HTTPS_DONE;
+        }
+    }
+    if (sent)
+    {
+        https_run(reqs + first, count - first, 2, 15000);
+    }
+    if (report >= 0)
+    {
+        reqs[ping].status = reqs[report].status;
+    }
+    int emptied = 1;
+    for (int i = 0; i < count; i++)
+    {
+        if (http_ok(reqs[i].status))
+        {
+            outbox_drop(list[i]);
+        }
+        else
+        {
+            emptied = 0;
+        }
+        https_req_free(&reqs[i]);
+    }
+    free(reqs);
+    return emptied;
 }
 
 #define LEDC_TIMER LEDC_TIMER_0
 #define LEDC_MODE LEDC_LOW_SPEED_MODE
 #define LEDC_DUTY_RES LEDC_TIMER_13_BIT // Set duty resolution to 13 bits
 #define LEDC_DUTY (4095)      // Set duty to 50%. ((2 ** 13) - 1) * 50% = 4095
+#if CONFIG_PLM_LED_FADE
+// the RC fast clock keeps the LEDC (and its fades) running while the
+// CPU light sleeps; at 13 bits it tops out near 1 kHz
+#define LEDC_FREQUENCY (500)
+#define LEDC_CLK LEDC_USE_RC_FAST_CLK
+#else
 #define LEDC_FREQUENCY (5000) // Frequency in Hertz. Set frequency at 5 kHz
+#define LEDC_CLK LEDC_AUTO_CLK
+#endif
 
 const int led_to_channel[GPIO_NUM_MAX] = {
     [RED_LED] = LEDC_CHANNEL_0,
 };
 void ledc_pwm_init(int led)
 {
-    // Prepare and then apply the LEDC PWM timer configuration
-    ledc_timer_config_t ledc_timer = {
-        .speed_mode = LEDC_MODE,
-        .timer_num = LEDC_TIMER,
-        .duty_resolution = LEDC_DUTY_RES,
-        .freq_hz = LEDC_FREQUENCY, // Set output frequency at 5 kHz
-        .clk_cfg = LEDC_AUTO_CLK};
-    ESP_ERROR_CHECK(ledc_timer_config(&ledc_timer));
+    // the LEDC takes over the pin
+    led_code_stop(led);
+    int64_t start = esp_timer_get_time();
+    if (!subsys_is_up(SUBSYS_LEDC))
+    {
+        // Prepare and then apply the LEDC PWM timer configuration
+        ledc_timer_config_t ledc_timer = {
+            .speed_mode = LEDC_MODE,
+            .timer_num = LEDC_TIMER,
+            .duty_resolution = LEDC_DUTY_RES,
+            .freq_hz = LEDC_FREQUENCY,
+            .clk_cfg = LEDC_CLK};
+        ESP_ERROR_CHECK(ledc_timer_config(&ledc_timer));
+#if CONFIG_PLM_LED_FADE
+        ESP_ERROR_CHECK(ledc_fade_func_install(0));
+#endif
+    }
 
     // Prepare and then apply the LEDC PWM channel configuration
     ledc_channel_config_t ledc_channel = {.speed_mode = LEDC_MODE,
@@ -545,11 +1108,16 @@ void ledc_pwm_init(int led)
                                           .duty = 0, // Set duty to 0%
                                           .hpoint = 0};
     ESP_ERROR_CHECK(ledc_channel_config(&ledc_channel));
+    // the pin belongs to the LEDC now; set_led has to take it back
+    led_ready &= ~(1u << led);
+    subsys_done(SUBSYS_LEDC, start);
 }
 
 void ledc_pwm_fini(int led, int idle)
 {
     ledc_stop(LEDC_MODE, led_to_channel[led], idle);
+    // back to the sleep setting a fade took it off
+    gpio_sleep_sel_en(led);
 }
 
 // set duty in tenths of a percent (0-1000)
@@ -562,27 +1130,451 @@ void set_led_duty(int led, int duty)
 }
 
 // full-burner =~ 14-18, pilot =~ 8-14, off =~ 0-6
-const int FLAME_OFF_MARK = 6 * FIXED_POINT;
-const int FLAME_ON_MARK = 8 * FIXED_POINT;
+RTC_RODATA_ATTR const int FLAME_OFF_MARK = 6 * FIXED_POINT;
+RTC_RODATA_ATTR const int FLAME_ON_MARK = 8 * FIXED_POINT;
+// the burner has its own band around 14, so a flame sitting near it
+// isn't counted as a burner cycle each time it wavers across
+RTC_RODATA_ATTR const int FLAME_BURNER_OFF_MARK = 13 * FIXED_POINT;
+RTC_RODATA_ATTR const int FLAME_BURNER_ON_MARK = 15 * FIXED_POINT;
+
+enum flame_state
+{
+    FLAME_OFF,
+    FLAME_PILOT,
+    FLAME_BURNER,
+};
+
+// Burner runtime since the last report. Every tick's reading is
+// classified and its time credited here, so gas usage doesn't depend
+// on the server catching the burner in a 30 minute sample.
+struct flame_runtime
+{
+    int state;
+    time_t last_sec;
+    uint32_t burner_s;
+    uint32_t pilot_s;
+    uint32_t burner_cycles;
+};
+
+static RTC_DATA_ATTR struct flame_runtime runtime;
+
+void runtime_init(struct flame_runtime* r)
+{
+    memset(r, 0, sizeof(*r));
+    r->state = FLAME_OFF;
+}
+
+// tick_sec is the nominal time between wakes; it is used instead of the
+// measured time if that looks wrong (first tick, or a long dead battery
+// sleep where nothing was sampled)
+void RTC_IRAM_ATTR runtime_update(struct flame_runtime* r, int flame_v,
+                                  time_t now, int tick_sec)
+{
+    int v = flame_v * FIXED_POINT;
+    int state = r->state;
+    if (v < FLAME_OFF_MARK)
+    {
+        state = FLAME_OFF;
+    }
+    else if (v > FLAME_BURNER_ON_MARK)
+    {
+        state = FLAME_BURNER;
+    }
+    else if (state == FLAME_BURNER && v >= FLAME_BURNER_OFF_MARK)
+    {
+        // still in the burner's band
+    }
+    else if (v > FLAME_ON_MARK || state == FLAME_BURNER)
+    {
+        // a burner that drops below its band is at most a pilot, even
+        // on its way out
+        state = FLAME_PILOT;
+    }
+    // otherwise between the off and on marks, stay where we were
+
+    int dt = now - r->last_sec;
+    if (!r->last_sec || dt <= 0 || dt > 2 * tick_sec)
+    {
+        dt = tick_sec;
+    }
+    r->last_sec = now;
+
+    if (state == FLAME_BURNER)
+    {
+        if (r->state != FLAME_BURNER)
+        {
+            r->burner_cycles++;
+        }
+        r->burner_s += dt;
+    }
+    else if (state == FLAME_PILOT)
+    {
+        r->pilot_s += dt;
+    }
+    r->state = state;
+}
+
+// start counting again once the totals have been reported
+void runtime_reported(struct flame_runtime* r)
+{
+    r->burner_s = 0;
+    r->pilot_s = 0;
+    r->burner_cycles = 0;
+}
 
 // Brownout is ~1360, and the voltage drops quickly from 1775
 // Ideally notification of low battery should give us at least 24h
-const int LOW_BATT_MARK = 1775 * FIXED_POINT;
-const int DEAD_BATT_MARK = 1600 * FIXED_POINT;
+RTC_RODATA_ATTR const int LOW_BATT_MARK = 1775 * FIXED_POINT;
+RTC_RODATA_ATTR const int DEAD_BATT_MARK = 1600 * FIXED_POINT;
 // as battery is charging, the value will go up. Once the value hits
 // 2028 the battery should be considered full and we can send
 // a message to that effect.
 // TODO: ideally, since the battery marks and battery percentages are
 //       specific to the battery itself, the values ought to be in
 //       a config rather than the code itself.
-const int FULL_BATT_MARK = 2028 * FIXED_POINT;
+RTC_RODATA_ATTR const int FULL_BATT_MARK = 2028 * FIXED_POINT;
+
+// The per-tick bookkeeping, shared by app_main and the wake stub, so it
+// has to be in RTC memory. Returns 1 if the CUSUM says the flame is out.
+static int RTC_IRAM_ATTR tick_update(int flame_v, int batt_v, time_t now,
+                                     int tick_sec)
+{
+    ema_update(&flame_v_ave, flame_v);
+    wmean_update(&batt_v_ave, batt_v);
+    runtime_update(&runtime, flame_v, now, tick_sec);
+    return cusum_update(&flame_cusum, flame_v * FIXED_POINT);
+}
+
+#if CONFIG_PLM_WAKE_STUB
+// Most ticks only sample the flame and battery and update the averages,
+// which doesn't need a full boot. app_main leaves a plan in RTC memory
+// before it sleeps, and the wake stub handles the ticks up to the next
+// report by itself as long as nothing looks out of the ordinary.
+struct stub_cal
+{
+    int32_t gain;   // mV per raw count, Q16
+    int32_t offset; // mV
+};
+
+struct wake_stub_plan
+{
+    int armed;
+    int boot_tick;      // first tick that has to run app_main
+    int batt_full_tick; // first tick a battery charged text can go out
+    int tick_sec;
+    time_t sec;         // RTC time of the last tick
+    uint16_t sar_code;  // the driver's SAR1 calibration code
+    struct stub_cal flame_cal;
+    struct stub_cal batt_cal;
+};
+static RTC_DATA_ATTR struct wake_stub_plan stub;
+
+// readings averaged per channel; a power of two
+#define STUB_ADC_READS 16
+
+// RTC_CNTL_FORCE_XPD_SAR: SAR power left to the sleep FSM, which turns
+// it off in deep sleep, or forced on
+#define STUB_SAR_POWER_FSM 0
+#define STUB_SAR_POWER_ON 3
+
+// Power the SAR ADC up for the stub's conversions. The digital reset
+// on wake has put its analog settings back to their defaults, so set
+// the reference and calibration code the ADC driver uses, or the raw
+// counts would not be on the scale the fits were made for.
+static void RTC_IRAM_ATTR stub_adc_begin(void)
+{
+    SET_PERI_REG_MASK(SYSTEM_PERIP_CLK_EN0_REG, SYSTEM_APB_SARADC_CLK_EN);
+    CLEAR_PERI_REG_MASK(SYSTEM_PERIP_RST_EN0_REG, SYSTEM_APB_SARADC_RST);
+    SET_PERI_REG_MASK(APB_SARADC_CLKM_CONF_REG, APB_SARADC_CLK_EN);
+    REG_SET_FIELD(APB_SARADC_CTRL_REG, APB_SARADC_SARADC_XPD_SAR_FORCE,
+                  STUB_SAR_POWER_ON);
+    REG_SET_FIELD(RTC_CNTL_SENSOR_CTRL_REG, RTC_CNTL_FORCE_XPD_SAR,
+                  STUB_SAR_POWER_ON);
+
+    CLEAR_PERI_REG_MASK(ANA_CONFIG_REG, ANA_I2C_SAR_FORCE_PD);
+    SET_PERI_REG_MASK(ANA_CONFIG2_REG, ANA_I2C_SAR_FORCE_PU);
+    esp_rom_regi2c_write_mask(I2C_SAR_ADC, I2C_SAR_ADC_HOSTID,
+                              ADC_SAR1_DREF_ADDR, ADC_SAR1_DREF_ADDR_MSB,
+                              ADC_SAR1_DREF_ADDR_LSB, 1);
+    esp_rom_regi2c_write_mask(I2C_SAR_ADC, I2C_SAR_ADC_HOSTID,
+                              ADC_SAR1_INITIAL_CODE_HIGH_ADDR,
+                              ADC_SAR1_INITIAL_CODE_HIGH_ADDR_MSB,
+                              ADC_SAR1_INITIAL_CODE_HIGH_ADDR_LSB,
+                              stub.sar_code >> 8);
+    esp_rom_regi2c_write_mask(I2C_SAR_ADC, I2C_SAR_ADC_HOSTID,
+                              ADC_SAR1_INITIAL_CODE_LOW_ADDR,
+                              ADC_SAR1_INITIAL_CODE_LOW_ADDR_MSB,
+                              ADC_SAR1_INITIAL_CODE_LOW_ADDR_LSB,
+                              stub.sar_code & 0xff);
+}
+
+// hand the SAR back to the sleep FSM so it is off through deep sleep
+static void RTC_IRAM_ATTR stub_adc_end(void)
+{
+    REG_SET_FIELD(RTC_CNTL_SENSOR_CTRL_REG, RTC_CNTL_FORCE_XPD_SAR,
+                  STUB_SAR_POWER_FSM);
+    REG_SET_FIELD(APB_SARADC_CTRL_REG, APB_SARADC_SARADC_XPD_SAR_FORCE, 0);
+    SET_PERI_REG_MASK(ANA_CONFIG_REG, ANA_I2C_SAR_FORCE_PD);
+    CLEAR_PERI_REG_MASK(ANA_CONFIG2_REG, ANA_I2C_SAR_FORCE_PU);
+    CLEAR_PERI_REG_MASK(APB_SARADC_CLKM_CONF_REG, APB_SARADC_CLK_EN);
+    CLEAR_PERI_REG_MASK(SYSTEM_PERIP_CLK_EN0_REG, SYSTEM_APB_SARADC_CLK_EN);
+}
+
+// A one-shot ADC1 conversion straight from the registers; none of the
+// ADC driver is available before the app is loaded. Only between
+// stub_adc_begin and stub_adc_end. Returns -1 if the conversion doesn't
+// finish.
+static int RTC_IRAM_ATTR stub_adc_read(int channel)
+{
+    REG_SET_FIELD(APB_SARADC_ONETIME_SAMPLE_REG,
+                  APB_SARADC_SARADC_ONETIME_CHANNEL, channel);
+    REG_SET_FIELD(APB_SARADC_ONETIME_SAMPLE_REG,
+                  APB_SARADC_SARADC_ONETIME_ATTEN, PLM_ADC_ATTEN);
+    SET_PERI_REG_MASK(APB_SARADC_ONETIME_SAMPLE_REG,
+                      APB_SARADC_SARADC1_ONETIME_SAMPLE);
+    SET_PERI_REG_MASK(APB_SARADC_INT_CLR_REG, APB_SARADC_ADC1_DONE_INT_CLR);
+    SET_PERI_REG_MASK(APB_SARADC_ONETIME_SAMPLE_REG,
+                      APB_SARADC_SARADC_ONETIME_START);
+    int raw = -1;
+    for (int i = 0; i < 10000; i++)
+    {
+        if (REG_GET_BIT(APB_SARADC_INT_RAW_REG, APB_SARADC_ADC1_DONE_INT_RAW))
+        {
+            raw = REG_GET_FIELD(APB_SARADC_1_DATA_STATUS_REG,
+                                APB_SARADC_ADC1_DATA) &
+                  0xfff;
+            break;
+        }
+    }
+    CLEAR_PERI_REG_MASK(APB_SARADC_ONETIME_SAMPLE_REG,
+                        APB_SARADC_SARADC_ONETIME_START |
+                            APB_SARADC_SARADC1_ONETIME_SAMPLE);
+    return raw;
+}
+
+// average a burst of conversions and calibrate it with the channel's
+// linear fit that app_main left behind; 0 if the ADC didn't give a
+// sane reading
+static int RTC_IRAM_ATTR stub_adc_mv(int channel, const struct stub_cal* cal,
+                                     int* mv)
+{
+    int sum = 0;
+    for (int i = 0; i < STUB_ADC_READS; i++)
+    {
+        int raw = stub_adc_read(channel);
+        if (raw <= 0 || raw >= 0xfff)
+        {
+            return 0;
+        }
+        sum += raw;
+    }
+    *mv = (int)(((int64_t)sum * cal->gain) >>
+                (16 + __builtin_ctz(STUB_ADC_READS))) +
+          cal->offset;
+    return 1;
+}
+
+// Handle a tick in the wake stub. Returns 0, having changed nothing,
+// if it needs app_main: a report or network retry is due, or the
+// reading would change the pilot or battery state, start a capture or
+// fill a tlog page.
+static int RTC_IRAM_ATTR stub_tick(void)
+{
+    int tick = sleep_count;
+    if (!stub.armed || tick >= stub.boot_tick || pilot_light_out)
+    {
+        return 0;
+    }
+    int flame_v;
+    int batt_v;
+    stub_adc_begin();
+    int ok = stub_adc_mv(PLM_ADC1_CHAN0, &stub.flame_cal, &flame_v) &&
+             stub_adc_mv(PLM_ADC1_CHAN1, &stub.batt_cal, &batt_v);
+    stub_adc_end();
+    if (!ok)
+    {
+        return 0;
+    }
+    // look ahead at what app_main would make of this reading
+    struct ema f = flame_v_ave;
+    struct cusum c = flame_cusum;
+    ema_update(&f, flame_v);
+    if (f.value < FLAME_OFF_MARK || cusum_update(&c, flame_v * FIXED_POINT))
+    {
+        return 0;
+    }
+#if CONFIG_PLM_CAPTURE
+    int step = flame_v * FIXED_POINT - f.value;
+    if (step > CONFIG_PLM_CAPTURE_STEP_MV * FIXED_POINT ||
+        -step > CONFIG_PLM_CAPTURE_STEP_MV * FIXED_POINT)
+    {
+        return 0;
+    }
+#endif
+    int32_t b = wmean_next(&batt_v_ave, batt_v);
+    if (b < LOW_BATT_MARK ||
+        (b > FULL_BATT_MARK && tick >= stub.batt_full_tick))
+    {
+        return 0;
+    }
+    time_t now = stub.sec + stub.tick_sec;
+    if (!tlog_stub_add(now, tick, flame_v, batt_v))
+    {
+        return 0;
+    }
+    stub.sec = now;
+    tick_update(flame_v, batt_v, now, stub.tick_sec);
+    sleep_count++;
+    return 1;
+}
+
+// the lowest raw count the ADC driver turns into at least mv
+static int raw_for_mv(int mv)
+{
+    int lo = 0;
+    int hi = 4095;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        int v;
+        adc_cali_raw_to_voltage(adc->cal, mid, &v);
+        if (v < mv)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// fit a line to the driver's calibration curve between mv_lo and mv_hi,
+// the range a channel's readings actually fall in
+static void stub_cal_fit(struct stub_cal* cal, int mv_lo, int mv_hi)
+{
+    int raw_lo = raw_for_mv(mv_lo);
+    int raw_hi = raw_for_mv(mv_hi);
+    if (raw_hi <= raw_lo)
+    {
+        raw_hi = raw_lo + 1;
+    }
+    adc_cali_raw_to_voltage(adc->cal, raw_lo, &mv_lo);
+    adc_cali_raw_to_voltage(adc->cal, raw_hi, &mv_hi);
+    cal->gain = ((mv_hi - mv_lo) << 16) / (raw_hi - raw_lo);
+    cal->offset = mv_lo - ((raw_lo * cal->gain) >> 16);
+}
+
+// Leave the plan for the wake stub; called by app_main just before it
+// goes back to sleep
+static void wake_stub_arm(int tick, time_t now, int tick_sec,
+                          int report_interval, int batt_full_tick)
+{
+    // the stub can only match the driver's readings with the eFuse
+    // calibration; without it, app_main takes every tick
+    stub.armed = 0;
+    if (!adc || !adc->cal)
+    {
+        return;
+    }
+    // reports and network retries are app_main's business
+    stub.boot_tick = outbox_next_attempt(tick, report_interval);
+    stub.batt_full_tick = batt_full_tick;
+    stub.tick_sec = tick_sec;
+    stub.sec = now;
+    // the same SAR calibration code the driver loads for this
+    // attenuation, and lines through the driver's curve for the stub's
+    // raw counts: the flame from cold to a full burner, and the battery
+    // from dead to charging
+    stub.sar_code = esp_efuse_rtc_calib_get_init_code(
+        esp_efuse_rtc_calib_get_ver(), ADC_UNIT_1, PLM_ADC_ATTEN);
+    stub_cal_fit(&stub.flame_cal, 0, 40);
+    stub_cal_fit(&stub.batt_cal, 1400, 2300);
+    stub.armed = 1;
+}
+#endif
+
+void RTC_IRAM_ATTR esp_wake_deep_sleep(void)
+{
+#if CONFIG_PLM_WAKE_STUB
+    if (stub_tick())
+    {
+        esp_wake_stub_set_wakeup_time(stub.tick_sec * 1000000ull);
+        esp_wake_stub_sleep(&esp_wake_deep_sleep);
+    }
+#endif
+    esp_default_wake_deep_sleep();
+    static RTC_RODATA_ATTR const char fmt_str[] = "Wake count %d\n";
+    esp_rom_printf(fmt_str, wake_count++);
+}
+
+#if CONFIG_PLM_LED_FADE
+// how often the flame is re-read while waiting for the network
+#define FLAME_FADE_MS 2000
+
+// Show the flame on the LED with hardware fades while blocking on the
+// notification, so the CPU can light sleep through Wi-Fi association.
+// Each FLAME_FADE_MS it wakes up to re-read the flame and fade to it.
+static int flame_to_led_fade(int timeout, const UBaseType_t* wait_on)
+{
+    int flame_v = 0;
+    // the same budget as the polling loop: about 2 seconds a count
+    int64_t deadline = esp_timer_get_time() + timeout * 2000000ll;
+    int notified = 0;
+    ledc_pwm_init(RED_LED);
+    // keep the LEDC clock running through light sleep, but only while
+    // fading; this setting applies to deep sleep too, so the reference
+    // it takes is given back below
+    esp_sleep_pd_config(ESP_PD_DOMAIN_RC_FAST, ESP_PD_OPTION_ON);
+    // PM_SLP_DISABLE_GPIO isolates every pin in light sleep, which would
+    // cut the LED just when the fade is meant to carry on by itself
+    gpio_sleep_sel_dis(RED_LED);
+    while (!notified)
+    {
+        read_adc(5, 0, &flame_v, NULL);
+        // flame only goes to 15 max
+        int duty = ((1 << 13) - 1) * MIN(flame_v, 15) / 15;
+        ledc_set_fade_with_time(LEDC_MODE, led_to_channel[RED_LED], duty,
+                                FLAME_FADE_MS / 2);
+        ledc_fade_start(LEDC_MODE, led_to_channel[RED_LED],
+                        LEDC_FADE_NO_WAIT);
+        int64_t left_ms = (deadline - esp_timer_get_time()) / 1000;
+        if (left_ms <= 0)
+        {
+            break;
+        }
+        TickType_t wait = pdMS_TO_TICKS(MIN(left_ms, FLAME_FADE_MS));
+        notified = ulTaskNotifyTakeIndexed(*wait_on, pdTRUE, wait) == 1;
+    }
+    ledc_pwm_fini(RED_LED, (flame_v * FIXED_POINT > FLAME_OFF_MARK) ? 0 : 1);
+    // ESP_PD_OPTION_AUTO would leave the reference held and RC_FAST
+    // powered through every deep sleep from here on
+    esp_sleep_pd_config(ESP_PD_DOMAIN_RC_FAST, ESP_PD_OPTION_OFF);
+    return notified;
+}
+#endif
 
 // timeout is approximately seconds, wait on is a notify identifier
 int flame_to_led(int timeout, const UBaseType_t* wait_on)
 {
-    struct windowed_ave f_v_ave;
+    if (wait_on && led_code_playing(RED_LED))
+    {
+        // the red LED is showing a code; leave it to finish and just wait
+        return ulTaskNotifyTakeIndexed(*wait_on, pdTRUE,
+                                       pdMS_TO_TICKS(timeout * 2000)) == 1;
+    }
+#if CONFIG_PLM_LED_FADE
+    if (wait_on)
+    {
+        return flame_to_led_fade(timeout, wait_on);
+    }
+#endif
+    struct ema f_v_ave;
+    struct median f_v_med;
     int flame_v = 0;
-    windowed_ave_init(&f_v_ave, 8);
+    ema_init(&f_v_ave);
+    median_init(&f_v_med, 3);
     ledc_pwm_init(RED_LED);
     int finder_timeout = timeout;
     while (--finder_timeout)
@@ -590,7 +1582,9 @@ int flame_to_led(int timeout, const UBaseType_t* wait_on)
         for (int j = 0; j < 20; j++)
         {
             read_adc(5, 0, &flame_v, NULL);
-            ave_new_value(&f_v_ave, flame_v);
+            // a single noisy reading shouldn't flash the LED
+            flame_v = median_update(&f_v_med, flame_v);
+            ema_update(&f_v_ave, flame_v);
             // flame only goes to 15 max
             int duty = MAX(1000, MIN(flame_v, 15) * 67); // 0-1000
             //    printf("flame_v = %d, duty = %d.%d\n", flame_v, duty / 10,
@@ -689,10 +1683,22 @@ void app_main(void)
     // get task ID for notifications
     xMainTask = xTaskGetCurrentTaskHandle();
 
+#if CONFIG_PLM_QEMU
+    // a simulated deep sleep comes back here rather than resetting
+    int wkup_cause = ESP_SLEEP_WAKEUP_UNDEFINED;
+    if (setjmp(sim_wake_point))
+    {
+        wkup_cause = ESP_SLEEP_WAKEUP_TIMER;
+    }
+    sim_wake_begin();
+    memset(subsys_us, 0, sizeof(subsys_us));
+#else
+    int wkup_cause = esp_sleep_get_wakeup_cause();
+#endif
+
     struct timeval now;
     gettimeofday(&now, NULL);
 
-    int wkup_cause = esp_sleep_get_wakeup_cause();
     printf("wakeup cause: 0x%x\n", wkup_cause);
     switch (wkup_cause)
     {
@@ -712,33 +1718,81 @@ void app_main(void)
     }
 
     // start with a solid green for each round for proof of life
-    init_led(GREEN_LED);
     set_led(GREEN_LED, 1);
 
     // Limit texts to once every 12 hours
     const int NOTIFY_LIMIT = 43200;
     int tick = sleep_count++;
+#if CONFIG_PLM_WAKE_STUB
+    // re-armed on the way back to sleep, unless this tick bails out early
+    stub.armed = 0;
+#endif
+    tlog_init(tick == 0, now.tv_sec);
+#if CONFIG_PLM_COAP
+    coap_init(tick == 0);
+#endif
     if (tick == 0)
     {
         pilot_light_out = 1;
         low_bat_count = -NOTIFY_LIMIT;
-        windowed_ave_init(&flame_v_ave, 8);
-        windowed_ave_init(&batt_v_ave, 32);
+        ema_init(&flame_v_ave);
+        wmean_init(&batt_v_ave);
+        cusum_init(&flame_cusum, FLAME_ON_MARK,
+                   CONFIG_PLM_CUSUM_DRIFT * FIXED_POINT / 10,
+                   CONFIG_PLM_CUSUM_THRESHOLD * FIXED_POINT / 10);
+        runtime_init(&runtime);
+        outbox_init();
         // at first boot, do a flame_to_led for proof of life and
         // ease of programming (a good time with no deep or light sleeps)
         flame_to_led(10, NULL);
     }
+    else
+    {
+        // Blink codes for what the last tick found, from its RTC state,
+        // so they play through this wake's sampling and networking
+        // instead of starting as it ends. Red is one code at a time; a
+        // pilot that is out matters more than the network.
+        if (pilot_light_out)
+        {
+            led_code(RED_LED, 0x5555);
+        }
+        else if (outbox_net_failing())
+        {
+            led_code(RED_LED, 0xff00ff);
+        }
+        if (batt_v_ave.value < LOW_BATT_MARK)
+        {
+            led_code(GREEN_LED, 0x5555);
+        }
+    }
+
+    // When the network is already known to be needed (a report, or
+    // something left in the outbox), start Wi-Fi now so association
+    // and DHCP overlap with sampling; the got-IP notification waits
+    // for the network phase to pick it up. Alerts raised by this
+    // tick's reading bring the network up later.
+    int report_tick = (tick % report_tick_interval) == 0;
+    int net_early =
+        outbox_attempt_due(tick, report_tick, report_tick_interval);
+    if (net_early)
+    {
+        init_wifi_power_save();
+    }
 
     int flame_v = 0;
     int batt_v = 0;
     // monitor the flame for a full second, with light sleep enabled
-    read_adc(50, 1, &flame_v, &batt_v);
-    ave_new_value(&flame_v_ave, flame_v);
-    ave_new_value(&batt_v_ave, batt_v);
+    // unless the radio is coming up (tickless idle still light sleeps)
+    read_adc(50, !net_early, &flame_v, &batt_v);
+    // the average takes several ticks to fall past FLAME_OFF_MARK; the
+    // CUSUM of the raw readings below FLAME_ON_MARK usually calls an
+    // outage a tick or two after it starts
+    int flame_low = tick_update(flame_v, batt_v, now.tv_sec, wakeup_time_sec);
+    tlog_add(now.tv_sec, tick, flame_v, batt_v);
     ESP_LOGI(TAG, "read_adc -> flame_v = %d, batt_v = %d (%d)\n", flame_v,
-             batt_v, ave_val(&batt_v_ave));
+             batt_v, q_round(batt_v_ave.value));
     int last_pilot_light_out = pilot_light_out;
-    if (flame_v_ave.value < FLAME_OFF_MARK)
+    if (flame_v_ave.value < FLAME_OFF_MARK || flame_low)
     {
         pilot_light_out = 1;
     }
@@ -747,11 +1801,29 @@ void app_main(void)
         pilot_light_out = 0;
     }
     int pilot_light_out_notify = pilot_light_out && !last_pilot_light_out;
+#if CONFIG_PLM_CAPTURE
+    // the 1s averages can't tell a slow fade from a blowout; catch the
+    // next few seconds at a high rate for the server to plot
+    if (tick != 0 && !capture_pending())
+    {
+        if (pilot_light_out != last_pilot_light_out)
+        {
+            capture_flame(now.tv_sec, pilot_light_out ? CAPTURE_FLAME_OUT
+                                                      : CAPTURE_FLAME_ON);
+        }
+        else if (abs(flame_v * FIXED_POINT - flame_v_ave.value) >
+                 CONFIG_PLM_CAPTURE_STEP_MV * FIXED_POINT)
+        {
+            capture_flame(now.tv_sec, CAPTURE_STEP);
+        }
+    }
+#endif
 
     if (batt_v_ave.value < DEAD_BATT_MARK)
     {
         // sleep for 5 whole report cycles; enough to trigger
         // a pilot light is dead watchdog
+        wifi_shutdown();
         deep_usleep(1000000ul * 5 * wakeup_time_sec * report_tick_interval);
     }
     int low_battery = batt_v_ave.value < LOW_BATT_MARK;
@@ -770,64 +1842,74 @@ void app_main(void)
         low_battery_notify = 0;
     }
 
-    if (pilot_light_out)
+    if (tick == 0)
+    {
+        outbox_push(OUTBOX_TELEMETRY, now.tv_sec,
+                    "alert=pilot_light_monitor_reboot");
+    }
+    if (report_tick || pilot_light_out_notify)
+    {
+        char q[OUTBOX_MSG_LEN];
+        // https://UPTIME_HOST/uptime/log?flame_v=702&batt_v=2032
+        snprintf(q, sizeof(q) - 1,
+                 "t=%d, flame_v=%d, flame_v_ave=%d.%03d, "
+                 "batt_p=%d, batt_v_ave=%d.%03d, heap=%d, "
+                 "burner_s=%lu, burner_cycles=%lu, pilot_s=%lu",
+                 tick, flame_v, q_whole(flame_v_ave.value),
+                 q_millis(flame_v_ave.value),
+                 batt_v_to_percent(batt_v_ave.value),
+                 q_whole(batt_v_ave.value), q_millis(batt_v_ave.value),
+                 esp_get_free_heap_size(),
+                 runtime.burner_s, runtime.burner_cycles, runtime.pilot_s);
+        // printf("log: %s\n", q);
+        outbox_push(OUTBOX_TELEMETRY, now.tv_sec, q);
+        // the totals are in the queued line now
+        runtime_reported(&runtime);
+    }
+    if (pilot_light_out_notify)
+    {
+        // printf("SMS: Pilot light is out\n");
+        outbox_push(OUTBOX_ALERT, now.tv_sec, "Pilot light is out");
+    }
+    if (low_battery_notify)
+    {
+        low_bat_count = tick;
+        // printf("SMS: Pilot light monitor low battery\n");
+        outbox_push(OUTBOX_ALERT, now.tv_sec,
+                    "Pilot light monitor low battery");
+    }
+    if (full_battery_notify)
     {
-        led_code(RED_LED, 0x5555);
+        low_bat_count = tick;
+        outbox_push(OUTBOX_ALERT, now.tv_sec,
+                    "Pilot light monitor battery charged");
     }
-    if (low_battery)
+    if (report_tick)
     {
-        led_code(GREEN_LED, 0x5555);
+        // send an uptime ping
+        outbox_push(OUTBOX_PING, now.tv_sec, NULL);
     }
-    if ((tick % report_tick_interval) == 0 || pilot_light_out_notify)
+    if (net_early ||
+        outbox_attempt_due(tick, report_tick, report_tick_interval))
     {
+        // already up if it was started early
         init_wifi_power_save();
         // wait for network
         uint32_t notify_value = flame_to_led(20, &xEthReadyIndex);
-        if (notify_value == 1)
+#if CONFIG_PLM_TLS_BENCH
+        if (tick == 0 && notify_value == 1)
         {
-            if (tick == 0)
-            {
-                ulog("alert=pilot_light_monitor_reboot");
-                // printf("alert=pilot_light_monitor_reboot\n");
-            }
-            char q[256];
-            // https://UPTIME_HOST/uptime/log?flame_v=702&batt_v=2032
-            snprintf(q, sizeof(q) - 1,
-                     "t=%d, flame_v=%d, flame_v_ave=%d.%03d, "
-                     "batt_p=%d, batt_v_ave=%d.%03d, heap=%d",
-                     tick, flame_v, ave_whole(&flame_v_ave),
-                     ave_millis(&flame_v_ave),
-                     batt_v_to_percent(batt_v_ave.value),
-                     ave_whole(&batt_v_ave), ave_millis(&batt_v_ave),
-                     esp_get_free_heap_size());
-            // printf("log: %s\n", q);
-            ulog(&q[0]);
-            if (pilot_light_out_notify)
-            {
-                // printf("SMS: Pilot light is out\n");
-                send_sms(alert_num, "Pilot light is out");
-            }
-            if (low_battery_notify)
-            {
-                low_bat_count = tick;
-                // printf("SMS: Pilot light monitor low battery\n");
-                send_sms(alert_num, "Pilot light monitor low battery");
-            }
-            if (full_battery_notify)
-            {
-                low_bat_count = tick;
-                send_sms(alert_num, "Pilot light monitor battery charged");
-            }
-            if ((tick % report_tick_interval) == 0)
-            {
-                // send an uptime ping
-                // printf("%s%s\n", UPTIME_HOST, "/uptime/pilot_light_ping");
-                https_get(UPTIME_HOST, "/uptime/pilot_light_ping", NULL);
-            }
+            https_bench(UPTIME_HOST, CONFIG_PLM_TLS_BENCH_ROUNDS);
         }
-        else
+#endif
+        int sent = (notify_value == 1) && outbox_send(now.tv_sec);
+        // any history kept through an outage goes up behind the outbox
+        sent = sent && tlog_upload(now.tv_sec);
+        sent = sent && capture_upload(now.tv_sec);
+        outbox_attempt_done(tick, sent, report_tick_interval);
+        if (!sent)
         {
-            led_code(RED_LED, 0xff00ff);
+            tlog_outage();
         }
         wifi_shutdown();
     }
@@ -844,5 +1926,10 @@ void app_main(void)
     }
 #endif
 
+#if CONFIG_PLM_WAKE_STUB
+    wake_stub_arm(tick, now.tv_sec, wakeup_time_sec, report_tick_interval,
+                  low_bat_count + NOTIFY_LIMIT / 2 / wakeup_time_sec);
+#endif
+    subsys_log();
     deep_usleep(wakeup_time_sec * 1000000);
 }
@@ -0,0 +1,282 @@
+/* Pilot Light Monitor
+ *
+ * Copyright 2023 Vernon Mauery <vernon@mauery.org>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+#include <sdkconfig.h>
+
+#if CONFIG_PLM_QEMU
+
+#include <esp_cpu.h>
+#include <esp_eth.h>
+#include <esp_log.h>
+#include <esp_netif.h>
+#include <esp_system.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "sim.h"
+
+extern const char* TAG;
+
+jmp_buf sim_wake_point;
+
+// main/sim/adc_trace.txt: one "<wakes> <flame mV> <battery mV>" line
+// per step of the script, read in order, one wake at a time
+extern const char adc_trace_start[] asm("_binary_adc_trace_txt_start");
+
+static const char* trace_pos;
+static int row_left;
+static int row_flame;
+static int row_batt;
+
+// what one wake cost; printed as its SIM line
+struct sim_stats
+{
+    int64_t start_us;
+    uint64_t cycles;
+    uint32_t cycles_last;
+    int requests;
+    int failed;
+    int coap;
+    int coap_lost;
+    uint32_t tx_frames;
+    uint32_t tx_bytes;
+    uint32_t rx_frames;
+    uint32_t rx_bytes;
+};
+
+static int sim_wakes;
+static struct sim_stats stats;
+
+/*---------------------------------------------------------------
+        ADC trace
+---------------------------------------------------------------*/
+// step to the trace row for the next wake; 0 once the trace runs out
+static int trace_next(void)
+{
+    if (!trace_pos)
+    {
+        trace_pos = adc_trace_start;
+    }
+    while (row_left == 0)
+    {
+        if (!*trace_pos)
+        {
+            return 0;
+        }
+        const char* eol = strchr(trace_pos, '\n');
+        size_t len = eol ? (size_t)(eol - trace_pos) : strlen(trace_pos);
+        char line[64];
+        snprintf(line, sizeof(line), "%.*s", (int)len, trace_pos);
+        trace_pos += eol ? len + 1 : len;
+        int n;
+        if (line[0] != '#' &&
+            sscanf(line, "%d %d %d", &n, &row_flame, &row_batt) == 3 && n > 0)
+        {
+            row_left = n;
+        }
+    }
+    row_left--;
+    return 1;
+}
+
+// take as long as read_adc would, minus the light sleep
+void sim_read_adc(int reps, int* ch0, int* ch1)
+{
+    vTaskDelay(reps * 20 / portTICK_PERIOD_MS);
+    if (ch0)
+    {
+        *ch0 = row_flame;
+    }
+    if (ch1)
+    {
+        *ch1 = row_batt;
+    }
+}
+
+int sim_flame_mv(void)
+{
+    return row_flame;
+}
+
+/*---------------------------------------------------------------
+        Cycle count
+---------------------------------------------------------------*/
+// The CPU cycle counter is 32 bits and wraps in under a minute at
+// 80 MHz, which a wake that waits on the network can outlast; fold it
+// into 64 bits from a timer well inside that.
+#define SIM_CYCLE_POLL_US (10 * 1000 * 1000)
+
+static esp_timer_handle_t cycle_timer;
+static portMUX_TYPE cycle_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static void cycles_poll(void* arg)
+{
+    taskENTER_CRITICAL(&cycle_lock);
+    uint32_t now = esp_cpu_get_cycle_count();
+    stats.cycles += (uint32_t)(now - stats.cycles_last);
+    stats.cycles_last = now;
+    taskEXIT_CRITICAL(&cycle_lock);
+}
+
+/*---------------------------------------------------------------
+        Wakes
+---------------------------------------------------------------*/
+void sim_wake_begin(void)
+{
+    if (!trace_next())
+    {
+        printf("SIM done wakes=%d\n", sim_wakes);
+        fflush(stdout);
+        esp_timer_stop(cycle_timer);
+        for (;;)
+        {
+            vTaskDelay(portMAX_DELAY);
+        }
+    }
+    if (!cycle_timer)
+    {
+        const esp_timer_create_args_t args = {
+            .callback = cycles_poll,
+            .name = "sim_cycles",
+        };
+        ESP_ERROR_CHECK(esp_timer_create(&args, &cycle_timer));
+        ESP_ERROR_CHECK(esp_timer_start_periodic(cycle_timer,
+                                                 SIM_CYCLE_POLL_US));
+    }
+    taskENTER_CRITICAL(&cycle_lock);
+    memset(&stats, 0, sizeof(stats));
+    stats.cycles_last = esp_cpu_get_cycle_count();
+    taskEXIT_CRITICAL(&cycle_lock);
+    stats.start_us = esp_timer_get_time();
+}
+
+// End the wake as deep sleep would: report it, move the clock on by
+// the sleep and start the next one from the top of app_main. RTC and
+// ordinary statics alike carry over, which only matters to code that
+// assumes a fresh boot on every wake.
+void sim_sleep(uint64_t us)
+{
+    cycles_poll(NULL);
+    printf("SIM wake=%d flame_mv=%d batt_mv=%d awake_us=%lld cycles=%llu "
+           "requests=%d failed=%d coap=%d coap_lost=%d tx_frames=%lu "
+           "tx_bytes=%lu rx_frames=%lu rx_bytes=%lu heap=%lu sleep_s=%llu\n",
+           sim_wakes, row_flame, row_batt,
+           esp_timer_get_time() - stats.start_us,
+           (unsigned long long)stats.cycles, stats.requests, stats.failed,
+           stats.coap, stats.coap_lost, (unsigned long)stats.tx_frames,
+           (unsigned long)stats.tx_bytes, (unsigned long)stats.rx_frames,
+           (unsigned long)stats.rx_bytes,
+           (unsigned long)esp_get_free_heap_size(),
+           (unsigned long long)(us / 1000000));
+    fflush(stdout);
+    sim_wakes++;
+
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    tv.tv_sec += us / 1000000;
+    settimeofday(&tv, NULL);
+    longjmp(sim_wake_point, 1);
+}
+
+void sim_https_done(int status)
+{
+    stats.requests++;
+    if (status < 200 || status >= 300)
+    {
+        stats.failed++;
+    }
+}
+
+void sim_coap_done(int acked)
+{
+    stats.coap++;
+    if (!acked)
+    {
+        stats.coap_lost++;
+    }
+}
+
+/*---------------------------------------------------------------
+        Emulated Ethernet
+---------------------------------------------------------------*/
+// Brought up and torn down with each wake, as Wi-Fi is. The frames go
+// through the usual glue, with a tally of them on the way.
+static esp_netif_t* sim_netif;
+static esp_eth_mac_t* sim_mac;
+static esp_eth_phy_t* sim_phy;
+static esp_eth_handle_t sim_eth;
+static esp_eth_netif_glue_handle_t sim_glue;
+
+static esp_err_t sim_eth_transmit(void* h, void* buffer, size_t len)
+{
+    stats.tx_frames++;
+    stats.tx_bytes += len;
+    return esp_eth_transmit(h, buffer, len);
+}
+
+static esp_err_t sim_eth_input(esp_eth_handle_t eth, uint8_t* buffer,
+                               uint32_t len, void* priv)
+{
+    stats.rx_frames++;
+    stats.rx_bytes += len;
+    return esp_netif_receive((esp_netif_t*)priv, buffer, len, NULL);
+}
+
+static void sim_eth_free(void* h, void* buffer)
+{
+    free(buffer);
+}
+
+void sim_net_up(void)
+{
+    esp_netif_config_t netif_cfg = ESP_NETIF_DEFAULT_ETH();
+    sim_netif = esp_netif_new(&netif_cfg);
+    assert(sim_netif);
+
+    eth_mac_config_t mac_cfg = ETH_MAC_DEFAULT_CONFIG();
+    eth_phy_config_t phy_cfg = ETH_PHY_DEFAULT_CONFIG();
+    // the emulated link is up at once
+    phy_cfg.autonego_timeout_ms = 100;
+    sim_mac = esp_eth_mac_new_openeth(&mac_cfg);
+    sim_phy = esp_eth_phy_new_dp83848(&phy_cfg);
+    esp_eth_config_t eth_cfg = ETH_DEFAULT_CONFIG(sim_mac, sim_phy);
+    ESP_ERROR_CHECK(esp_eth_driver_install(&eth_cfg, &sim_eth));
+    sim_glue = esp_eth_new_netif_glue(sim_eth);
+    ESP_ERROR_CHECK(esp_netif_attach(sim_netif, sim_glue));
+
+    // the glue has wired the netif and driver together; put the
+    // counting versions in between
+    const esp_netif_driver_ifconfig_t ifconfig = {
+        .handle = sim_eth,
+        .transmit = sim_eth_transmit,
+        .driver_free_rx_buffer = sim_eth_free,
+    };
+    ESP_ERROR_CHECK(esp_netif_set_driver_config(sim_netif, &ifconfig));
+    ESP_ERROR_CHECK(esp_eth_update_input_path(sim_eth, sim_eth_input,
+                                              sim_netif));
+    ESP_ERROR_CHECK(esp_eth_start(sim_eth));
+}
+
+void sim_net_down(void)
+{
+    ESP_ERROR_CHECK(esp_eth_stop(sim_eth));
+    ESP_ERROR_CHECK(esp_eth_del_netif_glue(sim_glue));
+    ESP_ERROR_CHECK(esp_eth_driver_uninstall(sim_eth));
+    ESP_ERROR_CHECK(sim_phy->del(sim_phy));
+    ESP_ERROR_CHECK(sim_mac->del(sim_mac));
+    esp_netif_destroy(sim_netif);
+    sim_netif = NULL;
+    sim_eth = NULL;
+}
+
+#endif
@@ -0,0 +1,35 @@
+/* Pilot Light Monitor
+ *
+ * Copyright 2023 Vernon Mauery <vernon@mauery.org>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+#pragma once
+
+#include <setjmp.h>
+#include <stdint.h>
+
+// Running under Espressif's QEMU (PLM_QEMU): the ADC readings come from
+// a scripted trace, the emulated OpenCores Ethernet stands in for Wi-Fi,
+// and deep sleep jumps back to the top of app_main with the clock moved
+// on instead of resetting. Each wake ends with one "SIM" line of stats
+// for tools/qemu-bench.py.
+
+// app_main's setjmp() target for the next wake
+extern jmp_buf sim_wake_point;
+
+void sim_wake_begin(void);
+void sim_sleep(uint64_t us) __attribute__((noreturn));
+
+// the trace's readings for this wake, in mV
+void sim_read_adc(int reps, int* ch0, int* ch1);
+int sim_flame_mv(void);
+
+void sim_net_up(void);
+void sim_net_down(void);
+
+// one request finished with this HTTP status (-1 if it failed), or a
+// CoAP report was acked (1) or not (0)
+void sim_https_done(int status);
+void sim_coap_done(int acked);
@@ -0,0 +1,389 @@
+/* Pilot Light Monitor
+ *
+ * Copyright 2023 Vernon Mauery <vernon@mauery.org>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+#include <esp_attr.h>
+#include <esp_log.h>
+#include <esp_partition.h>
+#include <esp_random.h>
+#include <esp_rom_crc.h>
+#include <sdkconfig.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "https.h"
+#include "tlog.h"
+
+extern const char* TAG;
+const char* device_id(void);
+
+// Store-and-forward telemetry log for outages too long for the outbox.
+//
+// Every tick's reading goes into a page buffer in RTC memory. While the
+// uptime host can't be reached, each full page is written to the tlog
+// partition with a single flash write. Once the network is back the
+// backlog goes up in large chunks, and each sector is erased when all
+// of its pages have been accepted. The log is a ring that only moves
+// forward, so every sector is erased equally often; if an outage
+// outlasts it, the oldest sector is dropped.
+//
+// Records are stamped with RTC seconds, which start over at zero after a
+// power cut, but the server works out real time from how far each one is
+// behind the clock at upload. So the log keeps its own clock: RTC seconds
+// plus an offset that, after a cold boot, starts the new boot's records
+// just after the last one still in flash. The length of the power cut is
+// lost; the order and spacing of the records are not.
+
+#define TLOG_PAGE_SIZE 256
+#define TLOG_SECTOR_SIZE 4096
+#define TLOG_PAGES_PER_SECTOR (TLOG_SECTOR_SIZE / TLOG_PAGE_SIZE)
+#define TLOG_MAGIC 0x474f4c54 // "TLOG"
+// pages per upload request
+#define TLOG_CHUNK_PAGES 8
+
+struct tlog_rec
+{
+    uint32_t sec; // RTC seconds + tlog_base
+    uint32_t tick;
+    uint16_t flame_v;
+    uint16_t batt_v;
+};
+
+#define TLOG_RECS ((TLOG_PAGE_SIZE - 16) / sizeof(struct tlog_rec))
+
+struct tlog_page
+{
+    uint32_t magic;
+    uint32_t seq;
+    uint16_t count;
+    uint16_t crc;
+    uint32_t reserved;
+    struct tlog_rec recs[TLOG_RECS];
+};
+_Static_assert(sizeof(struct tlog_page) == TLOG_PAGE_SIZE,
+               "tlog pages must match the flash page size");
+
+static RTC_DATA_ATTR struct tlog_page tlog_buf;
+static RTC_DATA_ATTR uint32_t tlog_seq;
+static RTC_DATA_ATTR int tlog_head;    // next flash page to write
+static RTC_DATA_ATTR int tlog_tail;    // oldest page not yet uploaded
+static RTC_DATA_ATTR int tlog_backlog; // pages waiting in flash
+static RTC_DATA_ATTR int tlog_pending; // outage seen, buffer is needed
+static RTC_DATA_ATTR uint32_t tlog_base; // RTC seconds to log clock
+
+static const esp_partition_t* tlog_part;
+static int tlog_pages;
+
+static uint16_t tlog_crc(const struct tlog_page* p)
+{
+    return esp_rom_crc16_le(0, (const uint8_t*)p->recs,
+                            p->count * sizeof(struct tlog_rec));
+}
+
+static int tlog_page_valid(const struct tlog_page* p)
+{
+    return p->magic == TLOG_MAGIC && p->count <= TLOG_RECS;
+}
+
+static void tlog_erase_sector(int page)
+{
+    int sector = page / TLOG_PAGES_PER_SECTOR;
+    ESP_ERROR_CHECK(esp_partition_erase_range(
+        tlog_part, sector * TLOG_SECTOR_SIZE, TLOG_SECTOR_SIZE));
+}
+
+// a cold boot loses the RTC copy of the ring pointers; rebuild them
+// from the page sequence numbers, since only unsent pages survive
+static void tlog_scan(time_t now)
+{
+    struct tlog_page hdr;
+    uint32_t min_seq = UINT32_MAX;
+    uint32_t max_seq = 0;
+    tlog_head = 0;
+    tlog_tail = 0;
+    tlog_backlog = 0;
+    for (int i = 0; i < tlog_pages; i++)
+    {
+        if (esp_partition_read(tlog_part, i * TLOG_PAGE_SIZE, &hdr, 16) !=
+                ESP_OK ||
+            !tlog_page_valid(&hdr))
+        {
+            continue;
+        }
+        tlog_backlog++;
+        if (hdr.seq < min_seq)
+        {
+            min_seq = hdr.seq;
+            tlog_tail = i;
+        }
+        if (hdr.seq >= max_seq)
+        {
+            max_seq = hdr.seq;
+            tlog_head = (i + 1) % tlog_pages;
+        }
+    }
+    // uploads are named after page sequence numbers, so an empty log
+    // starts somewhere new rather than reusing names the server has
+    // already seen; half the range leaves room to count up
+    tlog_seq = tlog_backlog ? max_seq + 1 : (esp_random() >> 1);
+    tlog_pending = tlog_backlog > 0;
+    // carry on from the newest record; if the RTC kept counting through
+    // the reset it is already past it
+    tlog_base = 0;
+    struct tlog_page last;
+    int newest = (tlog_head + tlog_pages - 1) % tlog_pages;
+    if (tlog_backlog > 0 &&
+        esp_partition_read(tlog_part, newest * TLOG_PAGE_SIZE, &last,
+                           TLOG_PAGE_SIZE) == ESP_OK &&
+        last.count > 0 && tlog_crc(&last) == last.crc)
+    {
+        uint32_t end = last.recs[last.count - 1].sec;
+        if (end >= (uint32_t)now)
+        {
+            tlog_base = end - (uint32_t)now + 1;
+        }
+    }
+    ESP_LOGI(TAG, "tlog: %d pages of backlog, clock +%lu s", tlog_backlog,
+             (unsigned long)tlog_base);
+}
+
+void tlog_init(int cold_boot, time_t now)
+{
+    tlog_part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, 0x40, "tlog");
+    if (!tlog_part)
+    {
+        ESP_LOGW(TAG, "no tlog partition; outage history disabled");
+        return;
+    }
+    tlog_pages = tlog_part->size / TLOG_PAGE_SIZE;
+    if (cold_boot)
+    {
+        memset(&tlog_buf, 0, sizeof(tlog_buf));
+        tlog_scan(now);
+    }
+}
+
+static void tlog_write_page(void)
+{
+    if (tlog_backlog > 0 && tlog_head % TLOG_PAGES_PER_SECTOR == 0 &&
+        tlog_head / TLOG_PAGES_PER_SECTOR == tlog_tail / TLOG_PAGES_PER_SECTOR)
+    {
+        // the ring has come round to the oldest sector, which is about
+        // to be erased: give up what is left of it to make room
+        int drop = TLOG_PAGES_PER_SECTOR - tlog_tail % TLOG_PAGES_PER_SECTOR;
+        ESP_LOGW(TAG, "tlog full, dropping %d pages", drop);
+        tlog_tail = (tlog_tail + drop) % tlog_pages;
+        tlog_backlog -= drop;
+    }
+    if (tlog_head % TLOG_PAGES_PER_SECTOR == 0)
+    {
+        // sectors are erased as soon as they are uploaded; only erase
+        // here if that didn't happen (a dropped or stale sector)
+        uint32_t magic;
+        esp_partition_read(tlog_part, tlog_head * TLOG_PAGE_SIZE, &magic,
+                           sizeof(magic));
+        if (magic != 0xffffffff)
+        {
+            tlog_erase_sector(tlog_head);
+        }
+    }
+    tlog_buf.magic = TLOG_MAGIC;
+    tlog_buf.seq = tlog_seq++;
+    tlog_buf.crc = tlog_crc(&tlog_buf);
+    ESP_ERROR_CHECK(esp_partition_write(tlog_part, tlog_head * TLOG_PAGE_SIZE,
+                                        &tlog_buf, TLOG_PAGE_SIZE));
+    tlog_head = (tlog_head + 1) % tlog_pages;
+    tlog_backlog++;
+}
+
+static inline __attribute__((always_inline)) void
+tlog_rec_add(time_t now, int tick, int flame_v, int batt_v)
+{
+    struct tlog_rec* r = &tlog_buf.recs[tlog_buf.count++];
+    r->sec = now + tlog_base;
+    r->tick = tick;
+    r->flame_v = flame_v;
+    r->batt_v = batt_v;
+}
+
+// tlog_add for the wake stub, which can't write flash: returns 0 if
+// this record would fill a page that has to be written
+int RTC_IRAM_ATTR tlog_stub_add(time_t now, int tick, int flame_v,
+                                int batt_v)
+{
+    if (tlog_buf.count + 1 >= TLOG_RECS)
+    {
+        if (tlog_pending)
+        {
+            return 0;
+        }
+        tlog_buf.count = 0;
+        return 1;
+    }
+    tlog_rec_add(now, tick, flame_v, batt_v);
+    return 1;
+}
+
+void tlog_add(time_t now, int tick, int flame_v, int batt_v)
+{
+    tlog_rec_add(now, tick, flame_v, batt_v);
+    if (tlog_buf.count < TLOG_RECS)
+    {
+        return;
+    }
+    // with the network up the live reports cover this page, so it only
+    // costs a flash write during an outage
+    if (tlog_pending && tlog_part)
+    {
+        tlog_write_page();
+    }
+    tlog_buf.count = 0;
+}
+
+// the uptime host couldn't be reached; start keeping history
+void tlog_outage(void)
+{
+    tlog_pending = 1;
+}
+
+// the longest lines an upload can hold, with room for the NUL
+#define TLOG_HEAD_MAX sizeof("now=4294967295\nbatch=4294967295\n")
+#define TLOG_LINE_MAX \
+    sizeof("4294967295: t=4294967295, flame_v=65535, batt_v=65535\n")
+
+static char* tlog_append_page(char* pos, const char* end,
+                              const struct tlog_page* p)
+{
+    for (int i = 0; i < p->count; i++)
+    {
+        const struct tlog_rec* r = &p->recs[i];
+        int len = snprintf(pos, end - pos,
+                           "%lu: t=%lu, flame_v=%u, batt_v=%u\n",
+                           (unsigned long)r->sec, (unsigned long)r->tick,
+                           r->flame_v, r->batt_v);
+        if (len < 0 || len >= end - pos)
+        {
+            // can't happen with the buffer sized from TLOG_LINE_MAX;
+            // leave off the partial line
+            *pos = '\0';
+            break;
+        }
+        pos += len;
+    }
+    return pos;
+}
+
+// A chunk of the backlog goes by the sequence number of its first page,
+// and the records still in RTC by the number their page will get. A
+// chunk that has to be retried starts at the same page, so it keeps its
+// name and the server can skip what it already has.
+static uint32_t tlog_batch(void)
+{
+    struct tlog_page hdr;
+    if (tlog_backlog > 0 &&
+        esp_partition_read(tlog_part, tlog_tail * TLOG_PAGE_SIZE, &hdr,
+                           16) == ESP_OK &&
+        tlog_page_valid(&hdr))
+    {
+        return hdr.seq;
+    }
+    return tlog_seq;
+}
+
+// Upload the backlog, oldest first, to the server's ingest endpoint as
+// text lines of "<sec>: <record>" after a "now=<sec>" line, so it can
+// turn log seconds into real time, and a "batch=<seq>" line naming the
+// chunk. Returns 1 once everything is uploaded.
+int tlog_upload(time_t now)
+{
+    if (!tlog_pending)
+    {
+        return 1;
+    }
+    const size_t max_len =
+        TLOG_HEAD_MAX + (TLOG_CHUNK_PAGES + 1) * TLOG_RECS * TLOG_LINE_MAX;
+    char* body = malloc(max_len);
+    if (!body)
+    {
+        return 0;
+    }
+    static const char uri_fmt[] = "%s/uptime/ingest/?dev=%s";
+    char uri[sizeof(CONFIG_PLM_UPTIME_HOST) + sizeof(uri_fmt) + 16];
+    snprintf(uri, sizeof(uri), uri_fmt, CONFIG_PLM_UPTIME_HOST, device_id());
+    int ok = 1;
+    while (ok && (tlog_backlog > 0 || tlog_buf.count > 0))
+    {
+        uint32_t batch = tlog_batch();
+        const char* end = body + max_len;
+        char* pos = body + snprintf(body, max_len, "now=%lu\nbatch=%lu\n",
+                                    (unsigned long)(now + tlog_base),
+                                    (unsigned long)batch);
+        const char* recs = pos;
+        int n = 0;
+        struct tlog_page page;
+        while (n < TLOG_CHUNK_PAGES && n < tlog_backlog)
+        {
+            int p = (tlog_tail + n) % tlog_pages;
+            esp_partition_read(tlog_part, p * TLOG_PAGE_SIZE, &page,
+                               TLOG_PAGE_SIZE);
+            if (tlog_page_valid(&page) && tlog_crc(&page) == page.crc)
+            {
+                pos = tlog_append_page(pos, end, &page);
+            }
+            n++;
+        }
+        // the records still in RTC go with the last chunk
+        int with_buf = (n == tlog_backlog);
+        if (with_buf)
+        {
+            pos = tlog_append_page(pos, end, &tlog_buf);
+        }
+        // a chunk of unreadable pages has nothing to send, but it still
+        // has to be moved past
+        int status = 204;
+        if (pos != recs)
+        {
+            status = https_post(uri, body, "text/plain", NULL, NULL);
+        }
+        ok = (status >= 200 && status < 300);
+        if (!ok)
+        {
+            break;
+        }
+        for (int i = 0; i < n; i++)
+        {
+            // the sector is only erased once all of it is sent; until
+            // then clearing the magic (flash can clear bits without an
+            // erase) keeps a reset from bringing the page back
+            static const uint32_t sent = 0;
+            esp_partition_write(tlog_part, tlog_tail * TLOG_PAGE_SIZE, &sent,
+                                sizeof(sent));
+            tlog_tail = (tlog_tail + 1) % tlog_pages;
+            tlog_backlog--;
+            if (tlog_tail % TLOG_PAGES_PER_SECTOR == 0)
+            {
+                tlog_erase_sector((tlog_tail + tlog_pages - 1) % tlog_pages);
+            }
+        }
+        if (with_buf)
+        {
+            tlog_buf.count = 0;
+        }
+        if (batch == tlog_seq)
+        {
+            // the name is taken now, even though no page has it
+            tlog_seq++;
+        }
+    }
+    free(body);
+    if (ok)
+    {
+        tlog_pending = 0;
+    }
+    return ok;
+}
@@ -0,0 +1,17 @@
+/* Pilot Light Monitor
+ *
+ * Copyright 2023 Vernon Mauery <vernon@mauery.org>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+
+void tlog_init(int cold_boot, time_t now);
+void tlog_add(time_t now, int tick, int flame_v, int batt_v);
+int tlog_stub_add(time_t now, int tick, int flame_v, int batt_v);
+void tlog_outage(void);
+int tlog_upload(time_t now);
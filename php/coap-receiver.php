@@ -0,0 +1,220 @@
+<?php
+
+// CoAP receiver for routine monitor reports
+//
+// usage: php coap-receiver.php <server-name> [<port>]
+//        php coap-receiver.php <server-name> --add-key <device-id> <hex-key>
+//
+// Firmware built with PLM_COAP sends each routine report as one signed
+// UDP datagram instead of an HTTPS request (main/coap.c has the
+// format). This checks the signature and the replay counter, then logs
+// the record and pets the watchdog just as report/ and log/ do in
+// index.php, and sends back a signed ack. Anything it can't take goes
+// unanswered and the monitor falls back to HTTPS.
+//
+// Like watchdogd.php, <server-name> picks the data/<server-name>/
+// directory. Each monitor's key has to be added with --add-key first;
+// it is the same hex string as PLM_DEVICE_KEY in that monitor's
+// menuconfig.
+
+if (php_sapi_name() != 'cli')
+{
+    exit();
+}
+if ($argc < 2)
+{
+    fwrite(STDERR, "usage: {$argv[0]} <server-name> [<port>]\n");
+    fwrite(STDERR, "       {$argv[0]} <server-name> --add-key <device-id> <hex-key>\n");
+    exit(1);
+}
+$_SERVER['SERVER_NAME'] = $argv[1];
+
+require_once 'uptime.php';
+
+define('COAP_VERSION', 1);
+define('COAP_TYPE_CON', 0);
+define('COAP_TYPE_ACK', 2);
+define('COAP_POST', 0x02);
+define('COAP_CHANGED', 0x44);
+define('COAP_OPT_URI_PATH', 11);
+define('COAP_OPT_URI_QUERY', 15);
+define('COAP_MAC_LEN', 16);
+
+// an option delta or length nibble, with its extended bytes
+function coap_ext($pkt, &$i, $v)
+{
+    if ($v == 13)
+    {
+        if ($i >= strlen($pkt))
+        {
+            return -1;
+        }
+        return 13 + ord($pkt[$i++]);
+    }
+    if ($v == 14)
+    {
+        if ($i + 2 > strlen($pkt))
+        {
+            return -1;
+        }
+        $v = 269 + unpack('n', substr($pkt, $i, 2))[1];
+        $i += 2;
+        return $v;
+    }
+    return ($v == 15) ? -1 : $v;
+}
+
+// Split a CoAP message into its parts; null if it is malformed
+function coap_parse($pkt)
+{
+    $len = strlen($pkt);
+    if ($len < 4)
+    {
+        return null;
+    }
+    $b = ord($pkt[0]);
+    $tkl = $b & 0x0f;
+    if (($b >> 6) != COAP_VERSION || $tkl > 8 || $len < 4 + $tkl)
+    {
+        return null;
+    }
+    $m = array('type' => ($b >> 4) & 3, 'code' => ord($pkt[1]),
+               'id' => substr($pkt, 2, 2), 'token' => substr($pkt, 4, $tkl),
+               'path' => array(), 'query' => array(), 'payload' => null);
+    $i = 4 + $tkl;
+    $opt = 0;
+    while ($i < $len)
+    {
+        $b = ord($pkt[$i++]);
+        if ($b == 0xff)
+        {
+            $m['payload'] = substr($pkt, $i);
+            break;
+        }
+        $delta = coap_ext($pkt, $i, $b >> 4);
+        $olen = coap_ext($pkt, $i, $b & 0x0f);
+        if ($delta < 0 || $olen < 0 || $i + $olen > $len)
+        {
+            return null;
+        }
+        $opt += $delta;
+        $val = substr($pkt, $i, $olen);
+        $i += $olen;
+        if ($opt == COAP_OPT_URI_PATH)
+        {
+            $m['path'][] = $val;
+        }
+        else if ($opt == COAP_OPT_URI_QUERY)
+        {
+            $m['query'][] = $val;
+        }
+    }
+    return $m;
+}
+
+function coap_mac($key, $data)
+{
+    return substr(hash_hmac('sha256', $data, $key, true), 0, COAP_MAC_LEN);
+}
+
+// Take one report; returns the ack to send back, or null to ignore it
+function coap_handle($db, $pkt)
+{
+    $m = coap_parse($pkt);
+    if ($m === null || $m['type'] != COAP_TYPE_CON || $m['code'] != COAP_POST ||
+        $m['payload'] === null || strlen($m['payload']) < 8 + COAP_MAC_LEN)
+    {
+        return null;
+    }
+    $dev = '';
+    foreach ($m['query'] as $q)
+    {
+        if (substr($q, 0, 4) == 'dev=')
+        {
+            $dev = strtolower(substr($q, 4));
+        }
+    }
+    $key = valid_device_id($dev) ? device_key($db, $dev) : null;
+    if ($key === null)
+    {
+        echo humanTime(time()) . ": no key for device '{$dev}'\n";
+        return null;
+    }
+    $mac = substr($pkt, -COAP_MAC_LEN);
+    if (!hash_equals(coap_mac($key, substr($pkt, 0, -COAP_MAC_LEN)), $mac))
+    {
+        echo humanTime(time()) . ": bad signature from {$dev}\n";
+        return null;
+    }
+    $counter = unpack('J', substr($m['payload'], 0, 8))[1];
+    $last = device_counter($db, $dev);
+    if ($counter < $last)
+    {
+        echo humanTime(time()) . ": replayed report from {$dev}\n";
+        return null;
+    }
+    // a resend of the last one lost its ack; ack it again
+    if ($counter > $last)
+    {
+        $p = $m['path'];
+        if (count($p) == 3 && $p[0] == 'uptime' && $p[1] == 'report' && $p[2] != '')
+        {
+            $watchdog = $p[2];
+        }
+        else if (count($p) == 2 && $p[0] == 'uptime' && $p[1] == 'log')
+        {
+            $watchdog = null;
+        }
+        else
+        {
+            return null;
+        }
+        $msg = substr($m['payload'], 8, -COAP_MAC_LEN);
+        if (strpos($msg, "\n") !== false)
+        {
+            return null;
+        }
+        store_record($db, $dev, record_line($msg), $watchdog);
+        // after the record, so a crash between can only log it twice
+        set_device_counter($db, $dev, $counter);
+    }
+    $ack = chr((COAP_VERSION << 6) | (COAP_TYPE_ACK << 4) | strlen($m['token'])) .
+        chr(COAP_CHANGED) . $m['id'] . $m['token'] . "\xff";
+    return $ack . coap_mac($key, $ack . $mac);
+}
+
+$db = init_db();
+if ($argc > 2 && $argv[2] == '--add-key')
+{
+    if ($argc != 5 || !valid_device_id(strtolower($argv[3])) ||
+        preg_match('/^([0-9a-fA-F]{2}){16,32}$/', $argv[4]) != 1)
+    {
+        fwrite(STDERR, "usage: {$argv[0]} <server-name> --add-key <device-id> <hex-key>\n");
+        exit(1);
+    }
+    set_device_key($db, strtolower($argv[3]), $argv[4]);
+    $db->close();
+    exit(0);
+}
+
+$port = ($argc > 2) ? intval($argv[2]) : 5683;
+$sock = stream_socket_server("udp://0.0.0.0:{$port}", $errno, $errstr,
+                             STREAM_SERVER_BIND);
+if (!$sock)
+{
+    fwrite(STDERR, "{$errstr}\n");
+    exit(1);
+}
+while (true)
+{
+    $pkt = stream_socket_recvfrom($sock, 1500, 0, $peer);
+    if ($pkt === false || $pkt === '')
+    {
+        continue;
+    }
+    $ack = coap_handle($db, $pkt);
+    if ($ack !== null)
+    {
+        stream_socket_sendto($sock, $ack, 0, $peer);
+    }
+}
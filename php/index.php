@@ -1,39 +1,10 @@
 <?php
 
-// TODO: MODIFY THESE CUSTOM VALUES
-$FROM_PHONE_NUMBER = '+15125551212';
-$TWILIO_SID = 'YOUR-TWILIO-SID-GOES-HERE';
-$TWILIO_TOKEN = 'YOUR-TWIIO-TOKEN-GOES-HERE';
-// END CUSTOM VALUES
+require_once 'uptime.php';
 
 $debug = true;
 $dbg_msgs = array();
 
-require_once 'Twilio/autoload.php';
-// Use the REST API Client to make requests to the Twilio REST API
-use Twilio\Rest\Client;
-
-function send_sms($to, $msg)
-{
-  global $FROM_PHONE_NUMBER;
-  global $TWILIO_SID;
-  global $TWILIO_TOKEN;
-
-  $client = new Client($TWILIO_SID, $TWILIO_TOKEN);
-
-  // Use the client to do fun stuff like send text messages!
-  $client->messages->create(
-    // the number you'd like to send the message to
-    $to,
-    [
-      // A Twilio phone number you purchased at twilio.com/console
-      'from' => $FROM_PHONE_NUMBER,
-      // the body of the text message you'd like to send
-      'body' => $msg
-    ]
-  );
-}
-
 function pb($b)
 {
     if ($b) {
@@ -115,36 +86,22 @@ function not_found()
     err_page('404 Not Found');
 }
 
-function data_dir()
-{
-    $cwd = realpath(dirname(__FILE__));
-    $ddir = $cwd . "/data/" . $_SERVER["SERVER_NAME"];
-    return $ddir;
-}
-
-function humanTime($ts)
-{
-    // 2021-Oct-12 02:05:00
-    return date('Y-M-d H:i:s', $ts);
-}
-
 function show_summary($db)
 {
     $d = "";
     $ts = time();
+    // watchdogd.php normally fires these; this keeps a cron curl working
+    $fired = check_watchdogs($db, $ts);
     $results = $db->query("SELECT * FROM watchdogs");
     while ($row = $results->fetchArray())
     {
-        if ($row["wdt_last_timestamp"] == 0)
+        if (in_array($row['wdt_name'], $fired))
         {
-            $d .= "<div>{$row['wdt_name']} expired</div>";
+            $d .= "<div>{$row['wdt_name']} fired</div>";
         }
-        else if ($ts > ($row["wdt_last_timestamp"] + $row["wdt_frequency"]))
+        else if ($row["wdt_last_timestamp"] == 0)
         {
-            // send a text on watchdogs
-            send_sms($row['wdt_sms_number'], $row['wdt_timeout_msg']);
-            $db->exec("UPDATE watchdogs SET wdt_last_timestamp=0 WHERE wdt_name=\"{$row["wdt_name"]}\"");
-            $d .= "<div>{$row['wdt_name']} fired</div>";
+            $d .= "<div>{$row['wdt_name']} expired</div>";
         }
         else
         {
@@ -153,6 +110,11 @@ function show_summary($db)
             $d .= "<div>{$name} OK ({$time_since_last}/{$row['wdt_frequency']})</div>";
         }
     }
+    $pending = $db->querySingle("SELECT COUNT(*) FROM sms_outbox WHERE sms_sent = 0");
+    if ($pending > 0)
+    {
+        $d .= "<div>{$pending} text(s) waiting to be sent</div>";
+    }
     if ($d == "") {
         $d = "Nothing to report. Now fuck off.";
     }
@@ -160,22 +122,212 @@ function show_summary($db)
 }
 
 
-function log_data()
+// the device ID is passed as dev=<id>; requests without one are ''
+function request_device()
+{
+    if (!isset($_REQUEST['dev']))
+    {
+        return '';
+    }
+    $dev = strtolower($_REQUEST['dev']);
+    if (!valid_device_id($dev))
+    {
+        dbg("bad device id");
+        err_page('400 Bad Request');
+    }
+    return $dev;
+}
+
+// The log line carried in the query string of a device GET, stamped
+// with when it was taken; null if there is nothing to log
+function request_log_line()
+{
+    // remove /uptime/log/ (or /uptime/report/<name>) from beginning
+    $msg = preg_replace(',^/uptime/[^?]*\??,', '', $_SERVER['REQUEST_URI']);
+    // and the device ID, which picks the log rather than going in it,
+    // and the CoAP counter
+    $msg = rtrim(preg_replace(',(?<![^&])(dev|coap)=[^&]*(&|$),', '', $msg),
+                 '&');
+    return record_line(urldecode($msg));
+}
+
+// A report that fell back to HTTPS after its CoAP datagram wasn't acked
+// passes that datagram's counter as coap=<n>; null if there is none
+function request_coap_counter()
+{
+    if (!isset($_REQUEST['coap']) || !ctype_digit($_REQUEST['coap']))
+    {
+        return null;
+    }
+    return intval($_REQUEST['coap']);
+}
+
+function log_data($db, $dev)
+{
+    $line = request_log_line();
+    if ($line === null)
+    {
+        return;
+    }
+    store_record($db, $dev, $line, null, request_coap_counter());
+}
+
+// A device report: what log/ takes plus a ping of the named watchdog,
+// in one request and one transaction. The device only looks at the
+// status, so there is no page to send back.
+function log_report($db, $dev, $name)
+{
+    if ($name == '')
+    {
+        not_found();
+    }
+    store_record($db, $dev, request_log_line(), $name,
+                 request_coap_counter());
+    header("HTTP/1.1 204 No Content");
+    exit();
+}
+
+// answer a device upload with a small JSON document
+function json_reply($status, $a)
+{
+    header("HTTP/1.1 {$status}");
+    header('Content-type: application/json');
+    echo json_encode($a) . "\n";
+    exit();
+}
+
+// POSTed history that the monitor kept in flash while it couldn't
+// reach us: a "now=<sec>" line with the device clock at upload time,
+// an optional "batch=<n>" line naming the batch, then one
+// "<sec>: <key>=<value>, ..." line per record on the same clock. The
+// whole batch is checked before any of it is stored, and the reply says
+// how much of it was taken.
+function ingest_data($db, $dev)
 {
-    $f = data_dir() . "/uptime.log";
-    if (false) {
-    // rotate files as needed
-    // keep 24-48 hours in current file; truncate, splitting on day boundaries
-    $first_current = new DateTime();
-    $first_current->setTime(0,0);
-    $first_current->sub(DateInterval::createFromDateString('1 day'));
-    $ts = $first_current->getTimestamp();
-    }
-    // remove /uptime/log/ from beginning
-    $msg = preg_replace(',/uptime/log[/?]*,', '', $_SERVER['REQUEST_URI']);
-    $msg = urldecode($msg);
     $t = time();
-    file_put_contents($f, "${t}: {$msg}\n", FILE_APPEND);
+    $now = null;
+    $batch = null;
+    $recs = array();
+    $n = 0;
+    foreach (explode("\n", file_get_contents('php://input')) as $line)
+    {
+        $n++;
+        if ($line == '')
+        {
+            continue;
+        }
+        if ($now === null && preg_match('/^now=([0-9]{1,10})$/', $line, $m) == 1)
+        {
+            $now = intval($m[1]);
+        }
+        else if ($batch === null && $now !== null &&
+                 preg_match('/^batch=([0-9]{1,10})$/', $line, $m) == 1)
+        {
+            $batch = intval($m[1]);
+        }
+        else if ($now !== null &&
+                 preg_match('/^([0-9]{1,10}): ([a-z_]+=[-0-9.]+(, [a-z_]+=[-0-9.]+)*)$/',
+                            $line, $m) == 1)
+        {
+            // older firmware could log records ahead of the clock when a
+            // power cut reset its RTC; all that is known is that they
+            // came before now
+            $ts = $t - max(0, $now - intval($m[1]));
+            $recs[] = "{$ts}: {$m[2]}";
+        }
+        else
+        {
+            json_reply('400 Bad Request',
+                       array('batch' => $batch, 'error' => "bad line {$n}"));
+        }
+    }
+    if (count($recs) == 0)
+    {
+        json_reply('400 Bad Request',
+                   array('batch' => $batch, 'error' => 'no records'));
+    }
+    $new = ingest_records($db, $dev, $batch, $recs);
+    json_reply('200 OK', array('batch' => $batch, 'records' => count($recs),
+                               'accepted' => $new));
+}
+
+// A device alert, POSTed as id=<n>&msg=<text>&mac=<hex>, to be texted
+// to the number of the watchdog it pets. Texts cost money and anyone
+// can reach this, so the alert has to be signed with the device's key
+// (the one coap-receiver.php --add-key stores): mac is the truncated
+// HMAC-SHA256 of "<dev>\n<name>\n<id>\n<msg>". It goes through the sms
+// outbox keyed on the device and message ID, so an alert the device
+// resends after a lost reply is only texted once.
+function alert_data($db, $dev, $name)
+{
+    if ($_SERVER['REQUEST_METHOD'] != 'POST')
+    {
+        err_page('405 Method Not Allowed');
+    }
+    $id = isset($_POST['id']) ? $_POST['id'] : '';
+    $msg = isset($_POST['msg']) ? $_POST['msg'] : '';
+    $mac = isset($_POST['mac']) ? $_POST['mac'] : '';
+    if (!ctype_digit($id) || $msg == '' || strlen($msg) > 320 ||
+        preg_match('/^[0-9a-f]{32}$/', $mac) != 1)
+    {
+        dbg("bad alert");
+        err_page('400 Bad Request');
+    }
+    $key = ($dev != '') ? device_key($db, $dev) : null;
+    $want = ($key === null) ? '' :
+        bin2hex(substr(hash_hmac('sha256', "{$dev}\n{$name}\n{$id}\n{$msg}",
+                                 $key, true), 0, 16));
+    if ($key === null || !hash_equals($want, $mac))
+    {
+        error_log("unsigned alert from '{$dev}' for {$name}");
+        err_page('403 Forbidden');
+    }
+    $to = watchdog_sms_number($db, $name);
+    if ($to === null)
+    {
+        // like report/, don't leave the device retrying forever
+        error_log("alert for unknown watchdog {$name}: {$msg}");
+    }
+    else
+    {
+        enqueue_sms($db, $to, $msg, "dev:{$dev}:{$id}");
+    }
+    header("HTTP/1.1 204 No Content");
+    exit();
+}
+
+// POSTed high-rate flame capture (main/capture.c): "key=value" lines
+// with the device clock at upload time, when the capture was taken,
+// why, the sample rate and count, and the base64 encoded samples
+function capture_data($db, $dev)
+{
+    $f = array();
+    foreach (explode("\n", file_get_contents('php://input')) as $line)
+    {
+        if (preg_match('/^([a-z]+)=(.*)$/', $line, $m) == 1)
+        {
+            $f[$m[1]] = $m[2];
+        }
+    }
+    foreach (array('now', 'sec', 'rate', 'count') as $k)
+    {
+        if (!isset($f[$k]) || !ctype_digit($f[$k]))
+        {
+            dbg("bad capture field {$k}");
+            err_page('400 Bad Request');
+        }
+    }
+    $data = isset($f['data']) ? base64_decode($f['data'], true) : false;
+    $reason = isset($f['reason']) ? $f['reason'] : '';
+    if ($data === false || preg_match('/^[a-z_]{1,16}$/', $reason) != 1 ||
+        intval($f['rate']) == 0)
+    {
+        dbg("bad capture");
+        err_page('400 Bad Request');
+    }
+    $ts = time() - max(0, intval($f['now']) - intval($f['sec']));
+    store_capture($db, $dev, $ts, $reason, intval($f['rate']),
+                  intval($f['count']), $data);
 }
 
 function mean($a)
@@ -240,18 +392,19 @@ function tail($fname, $n=1000)
   return file_get_contents($fname, false, null, $seek);
 }
 
-require_once 'jpgraph/jpgraph.php';
-require_once 'jpgraph/jpgraph_line.php';
-require_once 'jpgraph/jpgraph_date.php';
+// only the plot pages need jpgraph; keep it off the ping path
+function load_jpgraph()
+{
+  require_once 'jpgraph/jpgraph.php';
+  require_once 'jpgraph/jpgraph_line.php';
+  require_once 'jpgraph/jpgraph_date.php';
+}
 
 // special case for wh-usage (interpreting data, not just plotting)
-function wh_usage($d)
+function wh_usage($db, $dev, $d)
 {
   $q = 'flame_v_ave';
   // divide the samples into equal parts, taking averages
-  $log = data_dir() . "/uptime.log";
-  $lines = file_get_contents($log);
-  $lines = explode("\n", $lines);
   $ydata = array(array(), array());
   $yadata = array(array(), array());
   $qlen = strlen($q);
@@ -261,7 +414,7 @@ function wh_usage($d)
   $utc = new DateTime('now', new DateTimeZone('UTC'));
   $pdt = new DateTime('now', new DateTimeZone('America/Los_Angeles'));
   $delta_t = $pdt->getOffset() - $utc->getOffset();
-  foreach ($lines as $line)
+  foreach (log_lines($dev, $first) as $line)
   {
     if (strpos($line, $q)) {
       $parts = preg_split('/[&,;:\s]+/', $line, -1, PREG_SPLIT_NO_EMPTY);
@@ -290,47 +443,28 @@ function wh_usage($d)
       }
     }
   }
-  // go through ydata and look for bumps
-  // ave values above 10 are 'on'
-  $total_time_on = 0;
+  // burner intervals were found as the samples were logged
+  $total_time_on = burner_on_time($db, $dev, $first) / 60;
   $wh_data = array(array(), array());
-  $on = false;
-  for ($i=0; $i<count($ydata[0]); $i++)
-  {
-    if ($ydata[1][$i] > 10.5)
-    {
-      if (!$on)
-      {
-        $on_ts = $ydata[0][$i];
-        $on = true;
-      }
-    }
-    // $ydata[1][$i] <= 10.5
-    else
-    {
-      if ($on)
-      {
-        $on = false;
-        $off_ts = $ydata[0][$i];
-        $on_time = ($off_ts - $on_ts) / 60;
-        $total_time_on += $on_time;
-        $wh_data[0][] = $on_ts - 120;
-        $wh_data[1][] = 0;
-        $wh_data[0][] = $on_ts;
-        $wh_data[1][] = $on_time;
-        $wh_data[0][] = $off_ts;
-        $wh_data[1][] = $on_time;
-        $wh_data[0][] = $off_ts + 120;
-        $wh_data[1][] = 0;
-      }
-    }
-  }
-  if ($on)
+  foreach (burner_intervals($db, $dev, $first) as $r)
   {
+    $on_ts = $r['on_ts'] + $delta_t;
+    $off_ts = $r['off_ts'] + $delta_t;
+    $on_time = ($off_ts - $on_ts) / 60;
+    $wh_data[0][] = $on_ts - 120;
+    $wh_data[1][] = 0;
     $wh_data[0][] = $on_ts;
-    $on_time = ($ydata[0][-1] + 120 - $on_ts) / 60;
     $wh_data[1][] = $on_time;
-    $total_time_on += $on_time;
+    $wh_data[0][] = $off_ts;
+    $wh_data[1][] = $on_time;
+    $wh_data[0][] = $off_ts + 120;
+    $wh_data[1][] = 0;
+  }
+  $state = burner_state($db, $dev);
+  if ($state['on_ts'] && $state['on_ts'] >= $first)
+  {
+    $wh_data[0][] = $state['on_ts'] + $delta_t;
+    $wh_data[1][] = ($state['last_ts'] + 120 - $state['on_ts']) / 60;
   }
  
   $debug_data = false;
@@ -348,6 +482,7 @@ function wh_usage($d)
     not_found();
     return;
   }
+  load_jpgraph();
   // Width and height of the graph
   $width = 1600; $height = 600;
 
@@ -395,17 +530,14 @@ function wh_usage($d)
   $graph->Stroke();
 }
 
-function plot_data($q, $d)
+function plot_data($db, $dev, $q, $d)
 {
   if ($q == 'usage')
   {
-    return wh_usage($d);
+    return wh_usage($db, $dev, $d);
   }
   $q_ave = "{$q}_ave";
   // divide the samples into equal parts, taking averages
-  $log = data_dir() . "/uptime.log";
-  $lines = file_get_contents($log);
-  $lines = explode("\n", $lines);
   $xdata = array();
   $ydata = array(array(), array());
   $yadata = array(array(), array());
@@ -420,7 +552,7 @@ function plot_data($q, $d)
   $pdt = new DateTime('now', new DateTimeZone('America/Los_Angeles'));
   $delta_t = $pdt->getOffset() - $utc->getOffset();
   $ave = new Ave(10);
-  foreach ($lines as $line)
+  foreach (log_lines($dev, $first) as $line)
   {
     if (strpos($line, $q)) {
       $parts = preg_split('/[&,;:\s]+/', $line, -1, PREG_SPLIT_NO_EMPTY);
@@ -467,6 +599,9 @@ function plot_data($q, $d)
       }
     }
   }
+  // history uploaded after an outage lands in the log out of order
+  array_multisort($ydata[0], $ydata[1]);
+  array_multisort($yadata[0], $yadata[1]);
   $uptime = $last_tick * $ave->value;
   if ($uptime > 86400)
   {
@@ -514,6 +649,7 @@ function plot_data($q, $d)
     not_found();
     return;
   }
+  load_jpgraph();
   // Width and height of the graph
   $width = 1600; $height = 600;
 
@@ -566,20 +702,34 @@ function plot_data($q, $d)
   $graph->Stroke();
 }
 
-function get_plot_vars()
+function get_plot_vars($dev)
 {
   // divide the samples into equal parts, taking averages
-  $log = data_dir() . "/uptime.log";
-  $lines = tail($log);
-  $lines = explode("\n", $lines);
+  $line = '';
+  $lines = array();
+  if (file_exists(log_file($dev)))
+  {
+    $lines = explode("\n", tail(log_file($dev)));
+  }
   for ($n = sizeof($lines) - 1; $n >= 0; $n--)
   {
-    $line = $lines[$n];
-    if (strstr($line, ": t="))
+    if (strstr($lines[$n], ": t="))
     {
+      $line = $lines[$n];
       break;
     }
   }
+  if ($line == '')
+  {
+    // just after a rotation; look back through the last day instead
+    foreach (log_lines($dev, time() - 86400) as $l)
+    {
+      if (strstr($l, ": t="))
+      {
+        $line = $l;
+      }
+    }
+  }
   $names = array('usage');
   $out = array();
   if (!preg_match_all('/([_a-z0-9]+)=([_a-z0-9]+)/', $line, $allm))
@@ -598,7 +748,61 @@ function get_plot_vars()
   return $names;
 }
 
-function plot_all_data($d)
+// one high-rate capture, against milliseconds since it started
+function plot_capture($db, $id)
+{
+  $cap = capture($db, $id);
+  if (!$cap)
+  {
+    not_found();
+    return;
+  }
+  $samples = capture_decode($cap['cap_data'], $cap['cap_count']);
+  if (count($samples) == 0)
+  {
+    not_found();
+    return;
+  }
+  $xdata = array();
+  foreach ($samples as $i => $v)
+  {
+    $xdata[] = 1000.0 * $i / $cap['cap_rate'];
+  }
+  load_jpgraph();
+  $graph = new Graph(1600, 600);
+  $graph->SetScale('linlin');
+  $dev = ($cap['cap_dev'] == '') ? '' : " ({$cap['cap_dev']})";
+  $min = min($samples);
+  $max = max($samples);
+  $graph->title->Set("flame_v capture: {$cap['cap_reason']} at " .
+                     humanTime($cap['cap_ts']) . "{$dev}\n" .
+                     "{$cap['cap_rate']} Hz; [{$min}..{$max}]");
+  $graph->xaxis->title->Set('ms');
+  $graph->xgrid->Show();
+  $graph->xgrid->SetLineStyle("solid");
+  $graph->yaxis->title->Set('flame_v');
+  $plot = new LinePlot($samples, $xdata);
+  $plot->SetColor("black");
+  $graph->Add($plot);
+  $graph->Stroke();
+}
+
+// query string for links that stay on the same device and range
+function plot_query($dev, $d)
+{
+    $args = array();
+    if ($dev != '')
+    {
+      $args['dev'] = $dev;
+    }
+    if ($d != 1)
+    {
+      $args['d'] = $d;
+    }
+    return count($args) ? ("?" . http_build_query($args, '', '&amp;')) : "";
+}
+
+function plot_all_data($db, $dev, $d)
 {
     header("HTTP/1.1 200 ok");
 ?><!DOCTYPE html>
@@ -608,16 +812,42 @@ function plot_all_data($d)
  </head>
  <body>
 <?php
-    $vars = get_plot_vars();
-    foreach ($vars as $v)
+    $devs = devices();
+    if (count($devs) > 1)
     {
-      $p = "/uptime/plot/$v";
-      if ($d != 1)
+      echo "<div>";
+      foreach ($devs as $other)
       {
-        $p .= "?d={$d}";
+        $name = ($other == '') ? 'default' : $other;
+        if ($other == $dev)
+        {
+          echo " [{$name}]";
+        }
+        else
+        {
+          echo " <a href=\"/uptime/plots" . plot_query($other, $d) . "\">{$name}</a>";
+        }
       }
+      echo "</div>\n";
+    }
+    $vars = get_plot_vars($dev);
+    foreach ($vars as $v)
+    {
+      $p = "/uptime/plot/$v" . plot_query($dev, $d);
       echo "<div><h2>$v</h2><div><a href=\"{$p}\"><img src=\"{$p}\" alt=\"$v\"/></a></div></div>\n";
     }
+    $caps = captures($db, $dev, time() - $d * 86400);
+    if (count($caps) > 0)
+    {
+      echo "<div><h2>captures</h2><ul>\n";
+      foreach ($caps as $c)
+      {
+        $when = humanTime($c['cap_ts']);
+        $len = round($c['cap_count'] / $c['cap_rate'], 1);
+        echo "<li><a href=\"/uptime/capture/{$c['cap_id']}\">{$when}</a>: {$c['cap_reason']}, {$len}s at {$c['cap_rate']} Hz</li>\n";
+      }
+      echo "</ul></div>\n";
+    }
 ?>
  </body>
 </html>
@@ -627,8 +857,7 @@ function plot_all_data($d)
 
 function log_uptime($db, $q)
 {
-     $ts = time();
-     $db->exec("UPDATE watchdogs SET wdt_last_timestamp=$ts WHERE wdt_name=\"$q\"");
+     ping_watchdog($db, $q, time());
      msg_page("Uptime", "Thank you for reporting $q");
 }
 
@@ -644,22 +873,58 @@ function process_query($db) {
       $d = intval($_REQUEST['d']);
     }
     $q = $_REQUEST['q'];
+    $dev = request_device();
     if ($q == '' || $q == '/')
     {
         show_summary($db);
     }
     else if (substr($q, 0, 4) == "log/" || $q == "log")
     {
-      log_data();
+      if ($_SERVER['REQUEST_METHOD'] == 'POST')
+      {
+        // older firmware sent its backlog here
+        ingest_data($db, $dev);
+      }
+      else
+      {
+        log_data($db, $dev);
+      }
+    }
+    else if ($q == "ingest" || $q == "ingest/")
+    {
+      if ($_SERVER['REQUEST_METHOD'] != 'POST')
+      {
+        err_page('405 Method Not Allowed');
+      }
+      ingest_data($db, $dev);
+    }
+    else if (substr($q, 0, 6) == "alert/")
+    {
+      alert_data($db, $dev, substr($q, 6));
+    }
+    else if (substr($q, 0, 7) == "report/")
+    {
+      log_report($db, $dev, substr($q, 7));
     }
     else if ($q == "plots" || $q == "plots/")
     {
-      plot_all_data($d);
+      plot_all_data($db, $dev, $d);
+    }
+    else if (substr($q, 0, 8) == "capture/" || $q == "capture")
+    {
+      if ($_SERVER['REQUEST_METHOD'] == 'POST')
+      {
+        capture_data($db, $dev);
+      }
+      else
+      {
+        plot_capture($db, intval(substr($q, 8)));
+      }
     }
     else if (substr($q, 0, 5) == "plot/")
     {
       $v = substr($q, 5);
-      plot_data($v, $d);
+      plot_data($db, $dev, $v, $d);
     }
     else
     {
@@ -667,21 +932,6 @@ function process_query($db) {
     }
 }
 
-function init_db()
-{
-    $db = new SQLite3(data_dir() . "/uptime.sqlite3");
-    $init_tables = "CREATE TABLE IF NOT EXISTS watchdogs (
-                        wdt_id   INTEGER PRIMARY KEY,
-                        wdt_name TEXT NOT NULL,
-                        wdt_frequency INTEGER NOT NULL,
-                        wdt_last_timestamp INTEGER DEFAULT 0,
-                        wdt_sms_number TEXT NOT NULL,
-                        wdt_timeout_msg TEXT NOT NULL
-                      )";
-    $db->exec($init_tables);
-    return $db;
-}
-
 header("Cache-Control: no-cache, must-revalidate"); // HTTP/1.1
 header("Expires: Sat, 26 Jul 1997 05:00:00 GMT"); // Date in the past
 
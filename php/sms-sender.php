@@ -0,0 +1,54 @@
+<?php
+
+// Text message sender
+//
+// usage: php sms-sender.php <server-name> [--once]
+//
+// Delivers the alerts queued in sms_outbox, a batch at a time, retrying
+// failures with backoff. Like watchdogd.php, <server-name> selects the
+// data/<server-name>/ directory and --once does a single pass for cron.
+
+if (php_sapi_name() != 'cli')
+{
+    exit();
+}
+if ($argc < 2)
+{
+    fwrite(STDERR, "usage: {$argv[0]} <server-name> [--once]\n");
+    exit(1);
+}
+$_SERVER['SERVER_NAME'] = $argv[1];
+$once = ($argc > 2 && $argv[2] == '--once');
+
+require_once 'uptime.php';
+
+$BATCH = 10;
+// alerts are queued without waking us, so poll at least this often
+$MAX_SLEEP = 5;
+
+$db = init_db();
+while (true)
+{
+    do
+    {
+        $sent = deliver_sms($db, $BATCH);
+        foreach ($sent as $row)
+        {
+            $latency = $row['sms_sent'] - $row['sms_created'];
+            echo humanTime($row['sms_sent']) . ": sent {$row['sms_key']} to {$row['sms_to']}"
+                . " after {$latency}s, attempt " . ($row['sms_attempts'] + 1) . "\n";
+        }
+    } while (count($sent) == $BATCH);
+    if ($once)
+    {
+        break;
+    }
+    $next = next_sms_attempt($db);
+    $wait = $MAX_SLEEP;
+    if ($next > 0)
+    {
+        $wait = min($wait, max(1, $next - time()));
+    }
+    sleep($wait);
+}
+$db->close();
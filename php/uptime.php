@@ -0,0 +1,885 @@
+<?php
+
+// Shared by index.php and the command line tools (watchdogd.php,
+// sms-sender.php)
+
+// TODO: MODIFY THESE CUSTOM VALUES
+$FROM_PHONE_NUMBER = '+15125551212';
+$TWILIO_SID = 'YOUR-TWILIO-SID-GOES-HERE';
+$TWILIO_TOKEN = 'YOUR-TWIIO-TOKEN-GOES-HERE';
+// END CUSTOM VALUES
+
+// Use the REST API Client to make requests to the Twilio REST API
+use Twilio\Rest\Client;
+
+function send_sms($to, $msg)
+{
+  global $FROM_PHONE_NUMBER;
+  global $TWILIO_SID;
+  global $TWILIO_TOKEN;
+
+  static $client = null;
+  if (!$client)
+  {
+    // loaded on demand so pings don't pay for the autoloader
+    require_once 'Twilio/autoload.php';
+    $client = new Client($TWILIO_SID, $TWILIO_TOKEN);
+  }
+
+  // Use the client to do fun stuff like send text messages!
+  $message = $client->messages->create(
+    // the number you'd like to send the message to
+    $to,
+    [
+      // A Twilio phone number you purchased at twilio.com/console
+      'from' => $FROM_PHONE_NUMBER,
+      // the body of the text message you'd like to send
+      'body' => $msg
+    ]
+  );
+  return $message->sid;
+}
+
+// Alerts are queued in sms_outbox and delivered by sms-sender.php, so
+// whoever notices a problem never waits on Twilio. $key makes the
+// enqueue idempotent: a second alert with the same key is dropped.
+// Returns true if the message was queued.
+function enqueue_sms($db, $to, $msg, $key)
+{
+    $add = $db->prepare("INSERT OR IGNORE INTO sms_outbox
+                           (sms_key, sms_to, sms_body, sms_created, sms_next_attempt)
+                           VALUES (:key, :to, :body, :ts, :ts)");
+    $add->bindValue(':key', $key, SQLITE3_TEXT);
+    $add->bindValue(':to', $to, SQLITE3_TEXT);
+    $add->bindValue(':body', $msg, SQLITE3_TEXT);
+    $add->bindValue(':ts', time(), SQLITE3_INTEGER);
+    $add->execute();
+    return $db->changes() > 0;
+}
+
+// Try to send up to $batch queued messages that are due. Each attempt
+// pushes the message's next try out first (doubling, up to an hour), so
+// a failure or a crash mid-send only delays it. Returns the sent rows.
+function deliver_sms($db, $batch)
+{
+    $ts = time();
+    $sel = $db->prepare("SELECT * FROM sms_outbox
+                          WHERE sms_sent = 0 AND sms_next_attempt <= :ts
+                          ORDER BY sms_next_attempt LIMIT :batch");
+    $sel->bindValue(':ts', $ts, SQLITE3_INTEGER);
+    $sel->bindValue(':batch', $batch, SQLITE3_INTEGER);
+    $results = $sel->execute();
+    $due = array();
+    while ($row = $results->fetchArray(SQLITE3_ASSOC))
+    {
+        $due[] = $row;
+    }
+    $results->finalize();
+
+    $claim = $db->prepare("UPDATE sms_outbox
+                            SET sms_attempts=sms_attempts + 1, sms_next_attempt=:next
+                            WHERE sms_id=:id AND sms_sent=0 AND sms_next_attempt=:prev");
+    $done = $db->prepare("UPDATE sms_outbox SET sms_sent=:ts, sms_sid=:sid, sms_error=NULL
+                           WHERE sms_id=:id");
+    $fail = $db->prepare("UPDATE sms_outbox SET sms_error=:err WHERE sms_id=:id");
+    $sent = array();
+    foreach ($due as $row)
+    {
+        $backoff = min(60 << min($row['sms_attempts'], 6), 3600);
+        $claim->bindValue(':id', $row['sms_id'], SQLITE3_INTEGER);
+        $claim->bindValue(':prev', $row['sms_next_attempt'], SQLITE3_INTEGER);
+        $claim->bindValue(':next', $ts + $backoff, SQLITE3_INTEGER);
+        $claim->execute();
+        $claim->reset();
+        if ($db->changes() != 1)
+        {
+            // another sender got it
+            continue;
+        }
+        try
+        {
+            $sid = send_sms($row['sms_to'], $row['sms_body']);
+            $row['sms_sent'] = time();
+            $done->bindValue(':id', $row['sms_id'], SQLITE3_INTEGER);
+            $done->bindValue(':ts', $row['sms_sent'], SQLITE3_INTEGER);
+            $done->bindValue(':sid', $sid, SQLITE3_TEXT);
+            $done->execute();
+            $done->reset();
+            $sent[] = $row;
+        }
+        catch (Exception $e)
+        {
+            $fail->bindValue(':id', $row['sms_id'], SQLITE3_INTEGER);
+            $fail->bindValue(':err', $e->getMessage(), SQLITE3_TEXT);
+            $fail->execute();
+            $fail->reset();
+        }
+    }
+    return $sent;
+}
+
+// earliest retry time of anything unsent, or 0 if the outbox is empty
+function next_sms_attempt($db)
+{
+    $next = $db->querySingle("SELECT MIN(sms_next_attempt) FROM sms_outbox
+                               WHERE sms_sent = 0");
+    return intval($next);
+}
+
+function data_dir()
+{
+    $cwd = realpath(dirname(__FILE__));
+    $ddir = $cwd . "/data/" . $_SERVER["SERVER_NAME"];
+    return $ddir;
+}
+
+function humanTime($ts)
+{
+    // 2021-Oct-12 02:05:00
+    return date('Y-M-d H:i:s', $ts);
+}
+
+// Each monitor has its own directory, data/<host>/dev/<device-id>/, so
+// one device's queries never read another's records. Records without a
+// device ID (older firmware) live directly in data/<host>/, as device ''.
+function valid_device_id($dev)
+{
+    return preg_match('/^[0-9a-z_-]{1,32}$/', $dev) == 1;
+}
+
+function device_dir($dev)
+{
+    if ($dev == '')
+    {
+        return data_dir();
+    }
+    return data_dir() . "/dev/{$dev}";
+}
+
+// every device that has logged anything, legacy '' first
+function devices()
+{
+    $devs = array();
+    if (file_exists(data_dir() . "/uptime.log") || is_dir(data_dir() . "/log"))
+    {
+        $devs[] = '';
+    }
+    foreach (glob(data_dir() . "/dev/*", GLOB_ONLYDIR) as $d)
+    {
+        $devs[] = basename($d);
+    }
+    return $devs;
+}
+
+// The live log is <device dir>/uptime.log. Once a day it is split into
+// one gzip segment per day under <device dir>/log/, named by the day
+// its records belong to, so readers only open the days they ask for.
+function log_file($dev)
+{
+    return device_dir($dev) . "/uptime.log";
+}
+
+function log_segment_dir($dev)
+{
+    return device_dir($dev) . "/log";
+}
+
+function log_segment_name($dev, $day)
+{
+    return log_segment_dir($dev) . "/uptime-{$day}.log.gz";
+}
+
+function log_line_ts($line)
+{
+    return intval(substr($line, 0, strpos($line, ':')));
+}
+
+// Every writer holds this while touching uptime.log so a rotation
+// never loses an append to the file it is replacing
+function log_lock($dev)
+{
+    if (!is_dir(device_dir($dev)))
+    {
+        mkdir(device_dir($dev), 0775, true);
+    }
+    $lock = fopen(device_dir($dev) . "/uptime.lock", "c");
+    flock($lock, LOCK_EX);
+    return $lock;
+}
+
+function log_unlock($lock)
+{
+    flock($lock, LOCK_UN);
+    fclose($lock);
+}
+
+// Move anything older than today out of uptime.log and into compressed
+// day segments. Cheap when there is nothing to do: it only reads the
+// first line. The first run on an old, never rotated log splits the
+// whole history.
+function rotate_log($dev)
+{
+    $f = log_file($dev);
+    $today = date('Y-m-d');
+    $fh = @fopen($f, "r");
+    if (!$fh)
+    {
+        return;
+    }
+    $first = fgets($fh);
+    fclose($fh);
+    if ($first === false || date('Y-m-d', log_line_ts($first)) >= $today)
+    {
+        return;
+    }
+
+    $lock = log_lock($dev);
+    if (!is_dir(log_segment_dir($dev)))
+    {
+        mkdir(log_segment_dir($dev), 0775, true);
+    }
+    $fh = fopen($f, "r");
+    $tmp = "{$f}.tmp";
+    $keep = fopen($tmp, "w");
+    $seg = false;
+    $seg_day = '';
+    while (($line = fgets($fh)) !== false)
+    {
+        $day = date('Y-m-d', log_line_ts($line));
+        if ($day >= $today)
+        {
+            fwrite($keep, $line);
+            continue;
+        }
+        if ($day != $seg_day)
+        {
+            if ($seg)
+            {
+                gzclose($seg);
+            }
+            // appending adds a gzip member, which readers handle, so
+            // late records for an already rotated day are not lost
+            $seg = gzopen(log_segment_name($dev, $day), "ab9");
+            $seg_day = $day;
+        }
+        gzwrite($seg, $line);
+    }
+    if ($seg)
+    {
+        gzclose($seg);
+    }
+    fclose($fh);
+    fclose($keep);
+    rename($tmp, $f);
+    log_unlock($lock);
+}
+
+function log_append($dev, $lines)
+{
+    rotate_log($dev);
+    $lock = log_lock($dev);
+    file_put_contents(log_file($dev), $lines, FILE_APPEND);
+    log_unlock($lock);
+}
+
+// Yield the log lines from $first on, oldest first, opening only the
+// segments that can hold records from then on. Lines come out without
+// their newline; callers still need to check each line's timestamp.
+function log_lines($dev, $first)
+{
+    $segs = glob(log_segment_dir($dev) . "/uptime-*.log.gz");
+    sort($segs);
+    foreach ($segs as $seg)
+    {
+        $day = substr(basename($seg), strlen("uptime-"), 10);
+        if (strtotime("{$day} +1 day") <= $first)
+        {
+            continue;
+        }
+        $fh = gzopen($seg, "rb");
+        while (($line = gzgets($fh)) !== false)
+        {
+            yield rtrim($line, "\n");
+        }
+        gzclose($fh);
+    }
+    $fh = @fopen(log_file($dev), "r");
+    if ($fh)
+    {
+        while (($line = fgets($fh)) !== false)
+        {
+            yield rtrim($line, "\n");
+        }
+        fclose($fh);
+    }
+}
+
+// flame_v_ave above this means the burner is on, not just the pilot
+define('BURNER_ON_MARK', 10.5);
+
+// Burner on/off intervals are detected as records are logged rather
+// than by rescanning the log. Each finished interval stores cum_on, the
+// device's total burner seconds up to and including it, so the on-time
+// for any range is the difference of two lookups.
+function burner_state($db, $dev)
+{
+    $sel = $db->prepare("SELECT dev, on_ts, last_ts, total_on FROM burner_state WHERE dev=:dev");
+    $sel->bindValue(':dev', $dev, SQLITE3_TEXT);
+    $state = $sel->execute()->fetchArray(SQLITE3_ASSOC);
+    if (!$state)
+    {
+        $state = array('dev' => $dev, 'on_ts' => 0, 'last_ts' => 0, 'total_on' => 0);
+    }
+    return $state;
+}
+
+function burner_save_state($db, $state)
+{
+    $save = $db->prepare("INSERT OR REPLACE INTO burner_state (dev, on_ts, last_ts, total_on)
+                           VALUES (:dev, :on_ts, :last_ts, :total_on)");
+    $save->bindValue(':dev', $state['dev'], SQLITE3_TEXT);
+    $save->bindValue(':on_ts', $state['on_ts'], SQLITE3_INTEGER);
+    $save->bindValue(':last_ts', $state['last_ts'], SQLITE3_INTEGER);
+    $save->bindValue(':total_on', $state['total_on'], SQLITE3_INTEGER);
+    $save->execute();
+}
+
+// feed one flame_v_ave sample; samples must arrive in time order
+function burner_sample($db, &$state, $ts, $v)
+{
+    if ($ts <= $state['last_ts'])
+    {
+        return;
+    }
+    $state['last_ts'] = $ts;
+    if ($v > BURNER_ON_MARK)
+    {
+        if (!$state['on_ts'])
+        {
+            $state['on_ts'] = $ts;
+        }
+    }
+    else if ($state['on_ts'])
+    {
+        $state['total_on'] += $ts - $state['on_ts'];
+        $add = $db->prepare("INSERT OR REPLACE INTO burner_intervals (dev, on_ts, off_ts, cum_on)
+                              VALUES (:dev, :on_ts, :off_ts, :cum_on)");
+        $add->bindValue(':dev', $state['dev'], SQLITE3_TEXT);
+        $add->bindValue(':on_ts', $state['on_ts'], SQLITE3_INTEGER);
+        $add->bindValue(':off_ts', $ts, SQLITE3_INTEGER);
+        $add->bindValue(':cum_on', $state['total_on'], SQLITE3_INTEGER);
+        $add->execute();
+        $state['on_ts'] = 0;
+    }
+}
+
+function burner_sample_line($db, &$state, $line)
+{
+    if (preg_match('/flame_v_ave=([.0-9]+)/', $line, $m) == 1)
+    {
+        burner_sample($db, $state, log_line_ts($line), floatval($m[1]));
+    }
+}
+
+// burner seconds for the intervals that started at or after $first,
+// including one that is still running
+function burner_on_time($db, $dev, $first)
+{
+    $state = burner_state($db, $dev);
+    $start = $db->prepare("SELECT cum_on FROM burner_intervals WHERE dev=:dev AND on_ts < :first
+                            ORDER BY on_ts DESC LIMIT 1");
+    $start->bindValue(':dev', $dev, SQLITE3_TEXT);
+    $start->bindValue(':first', $first, SQLITE3_INTEGER);
+    $row = $start->execute()->fetchArray(SQLITE3_NUM);
+    // total_on is the cum_on of the device's last finished interval
+    $on = $state['total_on'] - ($row ? intval($row[0]) : 0);
+    if ($state['on_ts'] && $state['on_ts'] >= $first)
+    {
+        // counts through the end of the last sample period
+        $on += $state['last_ts'] + 120 - $state['on_ts'];
+    }
+    return $on;
+}
+
+function burner_intervals($db, $dev, $first)
+{
+    $sel = $db->prepare("SELECT on_ts, off_ts FROM burner_intervals WHERE dev=:dev AND on_ts >= :first
+                          ORDER BY on_ts");
+    $sel->bindValue(':dev', $dev, SQLITE3_TEXT);
+    $sel->bindValue(':first', $first, SQLITE3_INTEGER);
+    $results = $sel->execute();
+    $intervals = array();
+    while ($row = $results->fetchArray(SQLITE3_ASSOC))
+    {
+        $intervals[] = $row;
+    }
+    return $intervals;
+}
+
+// Flame captures are uploaded as the monitor stores them (main/capture.c):
+// each sample is the zigzag-encoded difference from the one before, in
+// a little-endian base-128 varint.
+function capture_decode($data, $count)
+{
+    $samples = array();
+    $v = 0;
+    $z = 0;
+    $shift = 0;
+    $len = strlen($data);
+    for ($i = 0; $i < $len && count($samples) < $count; $i++)
+    {
+        $b = ord($data[$i]);
+        $z |= ($b & 0x7f) << $shift;
+        $shift += 7;
+        if ($b & 0x80)
+        {
+            continue;
+        }
+        $v += ($z >> 1) ^ -($z & 1);
+        $samples[] = $v;
+        $z = 0;
+        $shift = 0;
+    }
+    return $samples;
+}
+
+function store_capture($db, $dev, $ts, $reason, $rate, $count, $data)
+{
+    $ins = $db->prepare("INSERT INTO captures (cap_dev, cap_ts, cap_reason, cap_rate, cap_count, cap_data)
+                          VALUES (:dev, :ts, :reason, :rate, :count, :data)");
+    $ins->bindValue(':dev', $dev, SQLITE3_TEXT);
+    $ins->bindValue(':ts', $ts, SQLITE3_INTEGER);
+    $ins->bindValue(':reason', $reason, SQLITE3_TEXT);
+    $ins->bindValue(':rate', $rate, SQLITE3_INTEGER);
+    $ins->bindValue(':count', $count, SQLITE3_INTEGER);
+    $ins->bindValue(':data', $data, SQLITE3_BLOB);
+    $ins->execute();
+    return $db->lastInsertRowID();
+}
+
+// A record from a device, stamped with when it was taken (one that
+// waited on the device says how long with age=); null if it is empty
+function record_line($msg)
+{
+    if ($msg == '')
+    {
+        return null;
+    }
+    $t = time();
+    if (preg_match('/(^|[ ,&])age=([0-9]+)/', $msg, $m) == 1)
+    {
+        $t -= intval($m[2]);
+    }
+    return "${t}: {$msg}";
+}
+
+// Log a device record (if there is one) and, for a report, pet the
+// device's watchdog, in one transaction. This is what log/, report/
+// and coap-receiver.php all come down to. $coap is the counter of a
+// CoAP datagram that carried the same record when it comes again over
+// HTTPS; if coap-receiver.php already took that one, only its ack was
+// lost and the record isn't logged twice. The counter only moves for a
+// signed datagram, never for this.
+function store_record($db, $dev, $line, $watchdog, $coap = null)
+{
+    if ($coap !== null && $coap <= device_counter($db, $dev))
+    {
+        $line = null;
+    }
+    if ($line !== null)
+    {
+        log_append($dev, "{$line}\n");
+    }
+    $db->exec("BEGIN IMMEDIATE");
+    if ($line !== null)
+    {
+        $state = burner_state($db, $dev);
+        burner_sample_line($db, $state, $line);
+        burner_save_state($db, $state);
+    }
+    if ($watchdog !== null)
+    {
+        // an unknown name is not the device's problem
+        ping_watchdog($db, $watchdog, time());
+    }
+    $db->exec("COMMIT");
+}
+
+// Store a batch of log lines (already stamped with server time, oldest
+// first) from a device upload. A device names each batch after where
+// it starts in its history and resends the whole thing, plus anything
+// logged since, until it is acknowledged; the records already stored
+// for that batch are skipped so a retry after a lost reply doesn't log
+// them twice. Everything goes into the log in one append. Returns how
+// many lines were new.
+function ingest_records($db, $dev, $batch, $lines)
+{
+    $db->exec("BEGIN IMMEDIATE");
+    $stored = 0;
+    if ($batch !== null)
+    {
+        $sel = $db->prepare("SELECT records FROM ingest_batches WHERE dev=:dev AND batch=:batch");
+        $sel->bindValue(':dev', $dev, SQLITE3_TEXT);
+        $sel->bindValue(':batch', $batch, SQLITE3_INTEGER);
+        $row = $sel->execute()->fetchArray(SQLITE3_NUM);
+        $stored = $row ? intval($row[0]) : 0;
+    }
+    $new = array_slice($lines, $stored);
+    if (count($new) > 0)
+    {
+        // only the log: these records have no flame_v_ave, and they are
+        // older than the live reports the burner intervals came from
+        log_append($dev, implode("\n", $new) . "\n");
+    }
+    if ($batch !== null)
+    {
+        $save = $db->prepare("INSERT OR REPLACE INTO ingest_batches (dev, batch, records, ts)
+                               VALUES (:dev, :batch, :records, :ts)");
+        $save->bindValue(':dev', $dev, SQLITE3_TEXT);
+        $save->bindValue(':batch', $batch, SQLITE3_INTEGER);
+        $save->bindValue(':records', max($stored, count($lines)), SQLITE3_INTEGER);
+        $save->bindValue(':ts', time(), SQLITE3_INTEGER);
+        $save->execute();
+    }
+    $db->exec("COMMIT");
+    return count($new);
+}
+
+// captures for a device since $first, newest first, without the samples
+function captures($db, $dev, $first)
+{
+    $sel = $db->prepare("SELECT cap_id, cap_ts, cap_reason, cap_rate, cap_count FROM captures
+                          WHERE cap_dev=:dev AND cap_ts >= :first ORDER BY cap_ts DESC");
+    $sel->bindValue(':dev', $dev, SQLITE3_TEXT);
+    $sel->bindValue(':first', $first, SQLITE3_INTEGER);
+    $results = $sel->execute();
+    $caps = array();
+    while ($row = $results->fetchArray(SQLITE3_ASSOC))
+    {
+        $caps[] = $row;
+    }
+    return $caps;
+}
+
+function capture($db, $id)
+{
+    $sel = $db->prepare("SELECT * FROM captures WHERE cap_id=:id");
+    $sel->bindValue(':id', $id, SQLITE3_INTEGER);
+    return $sel->execute()->fetchArray(SQLITE3_ASSOC);
+}
+
+// Fire every armed watchdog whose deadline has passed. A watchdog is
+// armed when wdt_next_deadline is non-zero; pinging it pushes the
+// deadline out and firing it disarms it until the next ping. The
+// deadline index keeps this cheap no matter how many watchdogs exist.
+// Returns the names of the watchdogs that fired.
+function check_watchdogs($db, $ts)
+{
+    $sel = $db->prepare("SELECT * FROM watchdogs
+                          WHERE wdt_next_deadline > 0 AND wdt_next_deadline < :ts
+                          ORDER BY wdt_next_deadline");
+    $sel->bindValue(':ts', $ts, SQLITE3_INTEGER);
+    $results = $sel->execute();
+    $expired = array();
+    while ($row = $results->fetchArray(SQLITE3_ASSOC))
+    {
+        $expired[] = $row;
+    }
+    $results->finalize();
+
+    // only the evaluator that wins the disarm queues the text, so the
+    // summary page and watchdogd.php can both run without double alerts;
+    // the key also dedups on the deadline that expired
+    $disarm = $db->prepare("UPDATE watchdogs SET wdt_last_timestamp=0, wdt_next_deadline=0
+                             WHERE wdt_id=:id AND wdt_next_deadline=:deadline");
+    $fired = array();
+    foreach ($expired as $row)
+    {
+        // disarm and enqueue together so the alert can't be lost between
+        $db->exec("BEGIN IMMEDIATE");
+        $disarm->bindValue(':id', $row['wdt_id'], SQLITE3_INTEGER);
+        $disarm->bindValue(':deadline', $row['wdt_next_deadline'], SQLITE3_INTEGER);
+        $disarm->execute();
+        $disarm->reset();
+        if ($db->changes() == 1)
+        {
+            enqueue_sms($db, $row['wdt_sms_number'], $row['wdt_timeout_msg'],
+                        "wdt:{$row['wdt_id']}:{$row['wdt_next_deadline']}");
+            $fired[] = $row['wdt_name'];
+        }
+        $db->exec("COMMIT");
+    }
+    return $fired;
+}
+
+// earliest armed deadline, or 0 if nothing is armed
+function next_watchdog_deadline($db)
+{
+    $next = $db->querySingle("SELECT MIN(wdt_next_deadline) FROM watchdogs
+                               WHERE wdt_next_deadline > 0");
+    return intval($next);
+}
+
+// Pet a watchdog, pushing its deadline out by its frequency.
+// This is the hot path for every device and heartbeat ping.
+// Returns false if there is no watchdog by that name.
+function ping_watchdog($db, $name, $ts)
+{
+    $pet = $db->prepare("UPDATE watchdogs
+                          SET wdt_last_timestamp=:ts, wdt_next_deadline=:ts + wdt_frequency
+                          WHERE wdt_name=:name");
+    $pet->bindValue(':ts', $ts, SQLITE3_INTEGER);
+    $pet->bindValue(':name', $name, SQLITE3_TEXT);
+    $pet->execute();
+    return $db->changes() > 0;
+}
+
+// the number a watchdog texts, or null if there is no such watchdog
+function watchdog_sms_number($db, $name)
+{
+    $sel = $db->prepare("SELECT wdt_sms_number FROM watchdogs WHERE wdt_name=:name");
+    $sel->bindValue(':name', $name, SQLITE3_TEXT);
+    $row = $sel->execute()->fetchArray(SQLITE3_NUM);
+    return $row ? $row[0] : null;
+}
+
+// The key a device signs its CoAP reports with, as raw bytes, or null
+// if it doesn't have one
+function device_key($db, $dev)
+{
+    $sel = $db->prepare("SELECT dev_key FROM device_keys WHERE dev=:dev");
+    $sel->bindValue(':dev', $dev, SQLITE3_TEXT);
+    $row = $sel->execute()->fetchArray(SQLITE3_NUM);
+    return $row ? hex2bin($row[0]) : null;
+}
+
+// a new key starts the replay counter over
+function set_device_key($db, $dev, $hex)
+{
+    $set = $db->prepare("INSERT OR REPLACE INTO device_keys (dev, dev_key, dev_counter)
+                          VALUES (:dev, :key, 0)");
+    $set->bindValue(':dev', $dev, SQLITE3_TEXT);
+    $set->bindValue(':key', strtolower($hex), SQLITE3_TEXT);
+    $set->execute();
+}
+
+// the last replay counter taken from a device
+function device_counter($db, $dev)
+{
+    $sel = $db->prepare("SELECT dev_counter FROM device_keys WHERE dev=:dev");
+    $sel->bindValue(':dev', $dev, SQLITE3_TEXT);
+    $row = $sel->execute()->fetchArray(SQLITE3_NUM);
+    return $row ? intval($row[0]) : 0;
+}
+
+function set_device_counter($db, $dev, $counter)
+{
+    $set = $db->prepare("UPDATE device_keys SET dev_counter=:counter WHERE dev=:dev");
+    $set->bindValue(':dev', $dev, SQLITE3_TEXT);
+    $set->bindValue(':counter', $counter, SQLITE3_INTEGER);
+    $set->execute();
+}
+
+function db_has_column($db, $table, $column)
+{
+    $cols = $db->query("PRAGMA table_info({$table})");
+    while ($col = $cols->fetchArray(SQLITE3_ASSOC))
+    {
+        if ($col['name'] == $column)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Schema changes, in order. PRAGMA user_version records how many have
+// been applied, so a request only touches the schema when it is out of
+// date. Never edit an entry once it has shipped; append a new one.
+function db_migrations()
+{
+    return array(
+        // 1: watchdogs
+        function ($db) {
+            $db->exec("CREATE TABLE IF NOT EXISTS watchdogs (
+                           wdt_id   INTEGER PRIMARY KEY,
+                           wdt_name TEXT NOT NULL,
+                           wdt_frequency INTEGER NOT NULL,
+                           wdt_last_timestamp INTEGER DEFAULT 0,
+                           wdt_sms_number TEXT NOT NULL,
+                           wdt_timeout_msg TEXT NOT NULL
+                         )");
+        },
+        // 2: deadline index for watchdogd.php
+        function ($db) {
+            // databases created before user_version was tracked may
+            // already have the column
+            if (!db_has_column($db, 'watchdogs', 'wdt_next_deadline'))
+            {
+                $db->exec("ALTER TABLE watchdogs ADD COLUMN wdt_next_deadline INTEGER DEFAULT 0");
+                $db->exec("UPDATE watchdogs SET wdt_next_deadline=wdt_last_timestamp + wdt_frequency
+                            WHERE wdt_last_timestamp > 0");
+            }
+            $db->exec("CREATE INDEX IF NOT EXISTS wdt_deadline_idx ON watchdogs(wdt_next_deadline)");
+        },
+        // 3: pings look watchdogs up by name
+        function ($db) {
+            // a ping used to update every row with the name, so keep
+            // the oldest of any duplicates
+            $db->exec("DELETE FROM watchdogs WHERE wdt_id NOT IN
+                         (SELECT MIN(wdt_id) FROM watchdogs GROUP BY wdt_name)");
+            $db->exec("CREATE UNIQUE INDEX IF NOT EXISTS wdt_name_idx ON watchdogs(wdt_name)");
+        },
+        // 4: burner intervals, detected as records are logged
+        function ($db) {
+            $db->exec("CREATE TABLE IF NOT EXISTS burner_state (
+                           id INTEGER PRIMARY KEY CHECK (id = 0),
+                           on_ts INTEGER NOT NULL,
+                           last_ts INTEGER NOT NULL,
+                           total_on INTEGER NOT NULL
+                         )");
+            $db->exec("CREATE TABLE IF NOT EXISTS burner_intervals (
+                           on_ts INTEGER PRIMARY KEY,
+                           off_ts INTEGER NOT NULL,
+                           cum_on INTEGER NOT NULL
+                         )");
+            // catch up on the history that is already logged. This is
+            // the replay as it shipped; the burner_*() helpers have since
+            // moved on to migration 6's tables, so it can't call them.
+            $state = array('on_ts' => 0, 'last_ts' => 0, 'total_on' => 0);
+            $add = $db->prepare("INSERT OR REPLACE INTO burner_intervals (on_ts, off_ts, cum_on)
+                                  VALUES (:on_ts, :off_ts, :cum_on)");
+            foreach (log_lines('', 0) as $line)
+            {
+                $ts = log_line_ts($line);
+                if (preg_match('/flame_v_ave=([.0-9]+)/', $line, $m) != 1 ||
+                    $ts <= $state['last_ts'])
+                {
+                    continue;
+                }
+                $state['last_ts'] = $ts;
+                if (floatval($m[1]) > BURNER_ON_MARK)
+                {
+                    if (!$state['on_ts'])
+                    {
+                        $state['on_ts'] = $ts;
+                    }
+                }
+                else if ($state['on_ts'])
+                {
+                    $state['total_on'] += $ts - $state['on_ts'];
+                    $add->bindValue(':on_ts', $state['on_ts'], SQLITE3_INTEGER);
+                    $add->bindValue(':off_ts', $ts, SQLITE3_INTEGER);
+                    $add->bindValue(':cum_on', $state['total_on'], SQLITE3_INTEGER);
+                    $add->execute();
+                    $add->reset();
+                    $state['on_ts'] = 0;
+                }
+            }
+            $save = $db->prepare("INSERT OR REPLACE INTO burner_state (id, on_ts, last_ts, total_on)
+                                   VALUES (0, :on_ts, :last_ts, :total_on)");
+            $save->bindValue(':on_ts', $state['on_ts'], SQLITE3_INTEGER);
+            $save->bindValue(':last_ts', $state['last_ts'], SQLITE3_INTEGER);
+            $save->bindValue(':total_on', $state['total_on'], SQLITE3_INTEGER);
+            $save->execute();
+        },
+        // 5: outgoing text messages
+        function ($db) {
+            $db->exec("CREATE TABLE IF NOT EXISTS sms_outbox (
+                           sms_id INTEGER PRIMARY KEY,
+                           sms_key TEXT NOT NULL UNIQUE,
+                           sms_to TEXT NOT NULL,
+                           sms_body TEXT NOT NULL,
+                           sms_created INTEGER NOT NULL,
+                           sms_next_attempt INTEGER NOT NULL,
+                           sms_attempts INTEGER NOT NULL DEFAULT 0,
+                           sms_sent INTEGER NOT NULL DEFAULT 0,
+                           sms_sid TEXT,
+                           sms_error TEXT
+                         )");
+            $db->exec("CREATE INDEX IF NOT EXISTS sms_pending_idx
+                         ON sms_outbox(sms_sent, sms_next_attempt)");
+        },
+        // 6: burner intervals per device
+        function ($db) {
+            $db->exec("ALTER TABLE burner_state RENAME TO burner_state_old");
+            $db->exec("ALTER TABLE burner_intervals RENAME TO burner_intervals_old");
+            $db->exec("CREATE TABLE burner_state (
+                           dev TEXT PRIMARY KEY,
+                           on_ts INTEGER NOT NULL,
+                           last_ts INTEGER NOT NULL,
+                           total_on INTEGER NOT NULL
+                         )");
+            $db->exec("CREATE TABLE burner_intervals (
+                           dev TEXT NOT NULL,
+                           on_ts INTEGER NOT NULL,
+                           off_ts INTEGER NOT NULL,
+                           cum_on INTEGER NOT NULL,
+                           PRIMARY KEY (dev, on_ts)
+                         )");
+            $db->exec("INSERT INTO burner_state SELECT '', on_ts, last_ts, total_on
+                         FROM burner_state_old");
+            $db->exec("INSERT INTO burner_intervals SELECT '', on_ts, off_ts, cum_on
+                         FROM burner_intervals_old");
+            $db->exec("DROP TABLE burner_state_old");
+            $db->exec("DROP TABLE burner_intervals_old");
+        },
+        // 7: high-rate flame captures
+        function ($db) {
+            $db->exec("CREATE TABLE IF NOT EXISTS captures (
+                           cap_id INTEGER PRIMARY KEY,
+                           cap_dev TEXT NOT NULL,
+                           cap_ts INTEGER NOT NULL,
+                           cap_reason TEXT NOT NULL,
+                           cap_rate INTEGER NOT NULL,
+                           cap_count INTEGER NOT NULL,
+                           cap_data BLOB NOT NULL
+                         )");
+            $db->exec("CREATE INDEX IF NOT EXISTS cap_dev_ts_idx ON captures(cap_dev, cap_ts)");
+        },
+        // 8: batches uploaded to ingest/, so a retry isn't logged twice
+        function ($db) {
+            $db->exec("CREATE TABLE IF NOT EXISTS ingest_batches (
+                           dev TEXT NOT NULL,
+                           batch INTEGER NOT NULL,
+                           records INTEGER NOT NULL,
+                           ts INTEGER NOT NULL,
+                           PRIMARY KEY (dev, batch)
+                         )");
+        },
+        // 9: keys for signed CoAP reports (coap-receiver.php)
+        function ($db) {
+            $db->exec("CREATE TABLE IF NOT EXISTS device_keys (
+                           dev TEXT PRIMARY KEY,
+                           dev_key TEXT NOT NULL,
+                           dev_counter INTEGER NOT NULL DEFAULT 0
+                         )");
+        },
+    );
+}
+
+function init_db()
+{
+    $db = new SQLite3(data_dir() . "/uptime.sqlite3");
+    // with WAL, readers never block the writer and a ping only waits
+    // behind another write, so a short timeout bounds the latency
+    $db->busyTimeout(2000);
+    $db->exec("PRAGMA synchronous=NORMAL");
+    $migrations = db_migrations();
+    $version = intval($db->querySingle("PRAGMA user_version"));
+    if ($version < count($migrations))
+    {
+        // journal_mode is persistent, so this only needs doing once
+        $db->exec("PRAGMA journal_mode=WAL");
+        $db->exec("BEGIN IMMEDIATE");
+        // someone else may have migrated while we waited for the lock
+        $version = intval($db->querySingle("PRAGMA user_version"));
+        for ($v = $version; $v < count($migrations); $v++)
+        {
+            $migrations[$v]($db);
+        }
+        $db->exec("PRAGMA user_version=" . count($migrations));
+        $db->exec("COMMIT");
+    }
+    return $db;
+}
@@ -0,0 +1,51 @@
+<?php
+
+// Background watchdog evaluator
+//
+// usage: php watchdogd.php <server-name> [--once]
+//
+// Sleeps until the earliest armed watchdog deadline, fires whatever has
+// expired and goes back to sleep. <server-name> selects the same
+// data/<server-name>/ directory that index.php uses for that virtual host.
+// With --once it does a single pass and exits, for use from cron.
+
+if (php_sapi_name() != 'cli')
+{
+    exit();
+}
+if ($argc < 2)
+{
+    fwrite(STDERR, "usage: {$argv[0]} <server-name> [--once]\n");
+    exit(1);
+}
+$_SERVER['SERVER_NAME'] = $argv[1];
+$once = ($argc > 2 && $argv[2] == '--once');
+
+require_once 'uptime.php';
+
+// wake at least this often to pick up newly added watchdogs
+$MAX_SLEEP = 60;
+
+$db = init_db();
+while (true)
+{
+    $ts = time();
+    foreach (check_watchdogs($db, $ts) as $name)
+    {
+        echo humanTime($ts) . ": {$name} fired\n";
+    }
+    if ($once)
+    {
+        break;
+    }
+    // pings only ever move deadlines later, so sleeping until the
+    // earliest one is safe; a watchdog fires once time() > deadline
+    $next = next_watchdog_deadline($db);
+    $wait = $MAX_SLEEP;
+    if ($next > 0)
+    {
+        $wait = min($wait, max(1, $next + 1 - time()));
+    }
+    sleep($wait);
+}
+$db->close();
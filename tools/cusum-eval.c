@@ -0,0 +1,253 @@
+/* Pilot Light Monitor
+ *
+ * Copyright 2023 Vernon Mauery <vernon@mauery.org>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+// Replay recorded flame readings through the pilot out detectors and
+// report how quickly each one calls an outage and how often it calls
+// one that isn't there.
+//
+// build: cc -O2 -I../main -o cusum-eval cusum-eval.c
+// usage: zcat -f uptime*.log* | sort -n | ./cusum-eval [-k drift] [-h threshold] [-r run]
+//
+// Input is the uptime server's log format, "<ts>: ... flame_v=<mV> ...";
+// lines without flame_v are skipped. Every-tick history (uploaded from
+// the monitor's flash log after an outage) gives the most useful
+// latencies; report lines alone are half an hour apart.
+//
+// An outage is taken to start at the first of at least <run> readings
+// in a row below FLAME_OFF_MARK and to last until a reading comes back
+// above FLAME_ON_MARK. drift and threshold are in tenths of a mV, as
+// in menuconfig.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cusum.h"
+#include "filter.h"
+
+// keep in step with main/pilot-light-monitor.c
+#define FLAME_OFF_MARK (6 * FIXED_POINT)
+#define FLAME_ON_MARK (8 * FIXED_POINT)
+
+struct sample
+{
+    long ts;
+    int flame_v;
+};
+
+struct result
+{
+    const char* name;
+    int detected;
+    int false_alarms;
+    long latency_sum;
+    long latency_max;
+    int samples_sum;
+};
+
+static struct sample* read_samples(FILE* in, size_t* count)
+{
+    size_t n = 0;
+    size_t cap = 1024;
+    struct sample* s = malloc(cap * sizeof(*s));
+    char line[1024];
+    while (s && fgets(line, sizeof(line), in))
+    {
+        const char* f = strstr(line, "flame_v=");
+        long ts;
+        if (!f || sscanf(line, "%ld:", &ts) != 1)
+        {
+            continue;
+        }
+        if (n == cap)
+        {
+            cap *= 2;
+            s = realloc(s, cap * sizeof(*s));
+            if (!s)
+            {
+                break;
+            }
+        }
+        s[n].ts = ts;
+        s[n].flame_v = atoi(f + strlen("flame_v="));
+        n++;
+    }
+    *count = n;
+    return s;
+}
+
+// mark the samples that fall inside an outage and return how many
+// outages there are
+static int mark_outages(const struct sample* s, size_t n, int run,
+                        int* outage, int* onset)
+{
+    int outages = 0;
+    size_t i = 0;
+    memset(outage, 0, n * sizeof(*outage));
+    while (i < n)
+    {
+        size_t j = i;
+        while (j < n && s[j].flame_v * FIXED_POINT < FLAME_OFF_MARK)
+        {
+            j++;
+        }
+        if (j - i < (size_t)run)
+        {
+            i = (j > i) ? j : i + 1;
+            continue;
+        }
+        while (j < n && s[j].flame_v * FIXED_POINT <= FLAME_ON_MARK)
+        {
+            j++;
+        }
+        for (size_t k = i; k < j; k++)
+        {
+            outage[k] = outages + 1;
+            onset[k] = i;
+        }
+        outages++;
+        i = j;
+    }
+    return outages;
+}
+
+// score one detector, given whether it says the pilot is out after
+// each sample
+static void score(struct result* r, const struct sample* s, size_t n,
+                  const int* alarm, const int* outage, const int* onset)
+{
+    int last = 1; // the monitor starts out assuming the worst
+    int last_detected = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        if (alarm[i] && !last)
+        {
+            if (!outage[i])
+            {
+                r->false_alarms++;
+            }
+            else if (outage[i] != last_detected)
+            {
+                long latency = s[i].ts - s[onset[i]].ts;
+                last_detected = outage[i];
+                r->detected++;
+                r->latency_sum += latency;
+                r->samples_sum += i - onset[i];
+                if (latency > r->latency_max)
+                {
+                    r->latency_max = latency;
+                }
+            }
+        }
+        last = alarm[i];
+    }
+}
+
+static void print_result(const struct result* r, int outages)
+{
+    printf("%-8s detected %d/%d", r->name, r->detected, outages);
+    if (r->detected)
+    {
+        printf(", latency mean %lds (%.1f samples), max %lds",
+               r->latency_sum / r->detected,
+               (double)r->samples_sum / r->detected, r->latency_max);
+    }
+    printf(", false alarms %d\n", r->false_alarms);
+}
+
+int main(int argc, char* argv[])
+{
+    int drift = 10;
+    int threshold = 80;
+    int run = 3;
+    int opt;
+    while ((opt = getopt(argc, argv, "k:h:r:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'k':
+                drift = atoi(optarg);
+                break;
+            case 'h':
+                threshold = atoi(optarg);
+                break;
+            case 'r':
+                run = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr,
+                        "usage: %s [-k drift] [-h threshold] [-r run] "
+                        "< log\n",
+                        argv[0]);
+                return 1;
+        }
+    }
+
+    size_t n;
+    struct sample* s = read_samples(stdin, &n);
+    if (!s || n == 0)
+    {
+        fprintf(stderr, "no flame_v samples\n");
+        return 1;
+    }
+    int* outage = malloc(n * sizeof(int));
+    int* onset = malloc(n * sizeof(int));
+    int* ema_alarm = malloc(n * sizeof(int));
+    int* both_alarm = malloc(n * sizeof(int));
+    if (!outage || !onset || !ema_alarm || !both_alarm)
+    {
+        return 1;
+    }
+    int outages = mark_outages(s, n, run, outage, onset);
+
+    // the same detectors as app_main, sample by sample
+    struct ema ave;
+    struct cusum cs;
+    ema_init(&ave);
+    cusum_init(&cs, FLAME_ON_MARK, drift * FIXED_POINT / 10,
+               threshold * FIXED_POINT / 10);
+    int ema_out = 1;
+    int both_out = 1;
+    for (size_t i = 0; i < n; i++)
+    {
+        ema_update(&ave, s[i].flame_v);
+        int low = cusum_update(&cs, s[i].flame_v * FIXED_POINT);
+        if (ave.value < FLAME_OFF_MARK)
+        {
+            ema_out = 1;
+        }
+        else if (ave.value > FLAME_ON_MARK)
+        {
+            ema_out = 0;
+        }
+        if (ave.value < FLAME_OFF_MARK || low)
+        {
+            both_out = 1;
+        }
+        else if (ave.value > FLAME_ON_MARK)
+        {
+            both_out = 0;
+        }
+        ema_alarm[i] = ema_out;
+        both_alarm[i] = both_out;
+    }
+
+    struct result ema_r = {.name = "ema"};
+    struct result both_r = {.name = "cusum"};
+    score(&ema_r, s, n, ema_alarm, outage, onset);
+    score(&both_r, s, n, both_alarm, outage, onset);
+    printf("%zu samples over %.1f days, %d outages; "
+           "drift %d.%d mV, threshold %d.%d mV\n",
+           n, (s[n - 1].ts - s[0].ts) / 86400.0, outages, drift / 10,
+           drift % 10, threshold / 10, threshold % 10);
+    print_result(&ema_r, outages);
+    print_result(&both_r, outages);
+    return 0;
+}
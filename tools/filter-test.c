@@ -0,0 +1,206 @@
+/* Pilot Light Monitor
+ *
+ * Copyright 2023 Vernon Mauery <vernon@mauery.org>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+// Check the fixed-point filters in main/filter.h against the same
+// filters worked in double precision.
+//
+// build: cc -O2 -I../main -o filter-test filter-test.c -lm
+// usage: ./filter-test [seed]
+//
+// Prints each mismatch and exits non-zero if there are any. The limits
+// are what the Q10 rounding allows:
+//   ema    within EMA_SHIFT + 1 LSB of the exact average on any input;
+//          settles to the input from above and below, and rounds back
+//          to it exactly
+//   median equal to the exact median, halves rounded up
+//   wmean  within half an LSB while the window fills, exact once full,
+//          and wmean_next agrees with the wmean_update after it
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "filter.h"
+
+static int failures;
+
+#define CHECK(cond, ...)                                                      \
+    do                                                                        \
+    {                                                                         \
+        if (!(cond))                                                          \
+        {                                                                     \
+            printf(__VA_ARGS__);                                              \
+            printf("\n");                                                     \
+            failures++;                                                       \
+        }                                                                     \
+    } while (0)
+
+// a thermocouple or battery reading: a level that wanders, with noise
+// and the odd spike
+static int next_sample(int* level)
+{
+    *level += rand() % 7 - 3;
+    if (*level < 0)
+    {
+        *level = 0;
+    }
+    if (*level > 3300)
+    {
+        *level = 3300;
+    }
+    int v = *level + rand() % 11 - 5;
+    if (rand() % 50 == 0)
+    {
+        v += rand() % 2000 - 1000;
+    }
+    return v < 0 ? 0 : v > 3300 ? 3300 : v;
+}
+
+static void test_ema(int runs)
+{
+    const double k = 1.0 / (1 << EMA_SHIFT);
+    const double lsb = 1.0 / FIXED_POINT;
+    for (int r = 0; r < runs; r++)
+    {
+        struct ema f;
+        ema_init(&f);
+        int level = rand() % 3300;
+        double ref = 0;
+        for (int i = 0; i < 2000; i++)
+        {
+            int x = next_sample(&level);
+            ema_update(&f, x);
+            ref = i ? ref + (x - ref) * k : x;
+            double err = f.value * lsb - ref;
+            CHECK(fabs(err) <= (EMA_SHIFT + 1) * lsb,
+                  "ema run %d sample %d: %.6f, want %.6f", r, i,
+                  f.value * lsb, ref);
+        }
+    }
+
+    // a step to a steady input, from either side: no bias toward zero,
+    // and the reported mV is the input
+    for (int from = 0; from <= 3300; from += 275)
+    {
+        for (int to = 0; to <= 3300; to += 330)
+        {
+            struct ema f;
+            ema_init(&f);
+            ema_update(&f, from);
+            CHECK(f.value == from * FIXED_POINT,
+                  "ema primed at %d: %ld", from, (long)f.value);
+            int steps = 0;
+            int32_t last;
+            do
+            {
+                last = f.value;
+                ema_update(&f, to);
+                steps++;
+            } while (f.value != last && steps < 1000);
+            int32_t err = f.value - to * FIXED_POINT;
+            CHECK(steps < 200, "ema %d -> %d still moving after %d", from,
+                  to, steps);
+            CHECK(err >= -(1 << (EMA_SHIFT - 1)) + 1 &&
+                      err <= (1 << (EMA_SHIFT - 1)),
+                  "ema %d -> %d settled %ld LSB off", from, to, (long)err);
+            CHECK(q_round(f.value) == to, "ema %d -> %d rounds to %d", from,
+                  to, q_round(f.value));
+        }
+    }
+}
+
+static int cmp_int(const void* a, const void* b)
+{
+    return *(const int*)a - *(const int*)b;
+}
+
+static void test_median(int runs)
+{
+    for (int size = 1; size <= MEDIAN_MAX; size++)
+    {
+        for (int r = 0; r < runs; r++)
+        {
+            struct median f;
+            median_init(&f, size);
+            int level = rand() % 3300;
+            int hist[64];
+            for (int i = 0; i < 64; i++)
+            {
+                hist[i] = next_sample(&level);
+                int got = median_update(&f, hist[i]);
+                // the last size samples, or fewer while it fills
+                int n = i + 1 < size ? i + 1 : size;
+                int w[MEDIAN_MAX];
+                for (int j = 0; j < n; j++)
+                {
+                    w[j] = hist[i - j];
+                }
+                qsort(w, n, sizeof(w[0]), cmp_int);
+                double exact =
+                    (n & 1) ? w[n / 2] : (w[n / 2 - 1] + w[n / 2]) / 2.0;
+                int want = (int)floor(exact + 0.5);
+                CHECK(got == want, "median/%d run %d sample %d: %d, want %d",
+                      size, r, i, got, want);
+            }
+        }
+    }
+}
+
+static void test_wmean(int runs)
+{
+    const double lsb = 1.0 / FIXED_POINT;
+    for (int r = 0; r < runs; r++)
+    {
+        struct wmean f;
+        wmean_init(&f);
+        int level = rand() % 3300;
+        int hist[256];
+        for (int i = 0; i < 256; i++)
+        {
+            hist[i] = next_sample(&level);
+            int32_t ahead = wmean_next(&f, hist[i]);
+            wmean_update(&f, hist[i]);
+            CHECK(ahead == f.value, "wmean run %d sample %d: next %ld, "
+                  "update %ld", r, i, (long)ahead, (long)f.value);
+            int n = i + 1 < WMEAN_SIZE ? i + 1 : WMEAN_SIZE;
+            double sum = 0;
+            for (int j = 0; j < n; j++)
+            {
+                sum += hist[i - j];
+            }
+            double err = f.value * lsb - sum / n;
+            if (n == WMEAN_SIZE)
+            {
+                CHECK(err == 0, "wmean run %d sample %d: %.6f, want %.6f",
+                      r, i, f.value * lsb, sum / n);
+            }
+            else
+            {
+                CHECK(fabs(err) <= 0.5 * lsb,
+                      "wmean run %d sample %d (filling): %.6f, want %.6f", r,
+                      i, f.value * lsb, sum / n);
+            }
+        }
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    unsigned seed = argc > 1 ? strtoul(argv[1], NULL, 0) : 1;
+    srand(seed);
+    test_ema(200);
+    test_median(200);
+    test_wmean(200);
+    if (failures)
+    {
+        printf("%d failures (seed %u)\n", failures, seed);
+        return 1;
+    }
+    printf("filters ok (seed %u)\n", seed);
+    return 0;
+}
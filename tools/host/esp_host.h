@@ -0,0 +1,55 @@
+/* Pilot Light Monitor
+ *
+ * Copyright 2023 Vernon Mauery <vernon@mauery.org>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+#pragma once
+
+// Just enough of ESP-IDF to build main/ sources into host tests; the
+// test supplies the functions
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef int esp_err_t;
+#define ESP_OK 0
+#define ESP_ERROR_CHECK(x)                                                    \
+    do                                                                        \
+    {                                                                         \
+        if ((x) != ESP_OK)                                                    \
+        {                                                                     \
+            fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #x);    \
+            abort();                                                          \
+        }                                                                     \
+    } while (0)
+
+#define RTC_DATA_ATTR
+#define RTC_IRAM_ATTR
+
+#define ESP_LOGE(tag, fmt, ...) printf("E %s: " fmt "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGW(tag, fmt, ...) printf("W %s: " fmt "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGI(tag, fmt, ...) printf("I %s: " fmt "\n", tag, ##__VA_ARGS__)
+
+typedef struct
+{
+    uint32_t address;
+    uint32_t size;
+} esp_partition_t;
+#define ESP_PARTITION_TYPE_DATA 1
+const esp_partition_t* esp_partition_find_first(int type, int subtype,
+                                                const char* label);
+esp_err_t esp_partition_read(const esp_partition_t* part, size_t offset,
+                             void* dst, size_t len);
+esp_err_t esp_partition_write(const esp_partition_t* part, size_t offset,
+                              const void* src, size_t len);
+esp_err_t esp_partition_erase_range(const esp_partition_t* part,
+                                    size_t offset, size_t len);
+
+uint32_t esp_random(void);
+uint16_t esp_rom_crc16_le(uint16_t crc, const uint8_t* buf, uint32_t len);
+
+typedef struct esp_tls esp_tls_t;
@@ -0,0 +1,234 @@
+#!/usr/bin/env python3
+#
+# Pilot Light Monitor
+#
+# Copyright 2023 Vernon Mauery <vernon@mauery.org>
+#
+# SPDX-License-Identifier: BSD-3-Clause
+#
+
+# Run a PLM_QEMU build under Espressif's QEMU against the stand-in
+# uptime host, and report what each wake cost: time awake, CPU cycles,
+# requests and the Ethernet traffic they took. The firmware replays
+# main/sim/adc_trace.txt, one wake per reading, and the run ends with
+# the trace.
+#
+# usage: ./qemu-bench.py [-v] [--json out.json] [--compare base.json]
+#                        [--latency ms] [--loss p] [--drop p]
+#                        [--resumption tickets|off] <build-dir>
+#
+# The build directory has to be configured with sdkconfig.qemu on top
+# of sdkconfig.defaults; "idf.py qemu-bench" in that directory runs this
+# after building. Save a run with --json and pass it to --compare on a
+# later one to see what a change did to the totals.
+#
+# The network options are handed to the stand-in to make the link
+# slower or lossier; its view of each request (handshake and transfer
+# times, TLS bytes, whether the session was resumed) is kept in
+# standin-timing.jsonl in the build directory and summed up after the
+# wakes.
+
+import argparse
+import json
+import os
+import re
+import subprocess
+import sys
+import threading
+from urllib.parse import urlsplit
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+
+SIM_LINE = re.compile(r'^SIM wake=')
+TOTALS = ('awake_us', 'cycles', 'requests', 'failed', 'coap', 'coap_lost',
+          'tx_frames', 'tx_bytes', 'rx_frames', 'rx_bytes')
+
+
+def build_config(build):
+    with open(os.path.join(build, 'config', 'sdkconfig.json')) as f:
+        return json.load(f)
+
+
+# one flash image holding the bootloader, partition table and app, as
+# QEMU wants it
+def flash_image(build, size):
+    image = os.path.join(build, 'qemu_flash.bin')
+    subprocess.run([sys.executable, '-m', 'esptool', '--chip', 'esp32c3',
+                    'merge_bin', '--fill-flash-size', size, '-o', image,
+                    '@flash_args'], cwd=build, check=True,
+                   stdout=subprocess.DEVNULL)
+    return image
+
+
+def parse_sim(line):
+    w = {}
+    for field in line.split()[1:]:
+        k, v = field.split('=', 1)
+        w[k] = int(v)
+    return w
+
+
+def run(args, cfg):
+    image = flash_image(args.build, cfg['ESPTOOLPY_FLASHSIZE'])
+    port = urlsplit(cfg['PLM_UPTIME_HOST']).port or 443
+    log = open(os.path.join(args.build, 'standin.log'), 'w')
+    timing = os.path.join(args.build, 'standin-timing.jsonl')
+    if os.path.exists(timing):
+        os.remove(timing)
+    cmd = [sys.executable, os.path.join(HERE, 'uptime-standin.py'),
+           '--port', str(port), '--timing', timing,
+           '--latency', str(args.latency), '--loss', str(args.loss),
+           '--drop', str(args.drop), '--resumption', args.resumption,
+           '--seed', '1']
+    standin = subprocess.Popen(cmd, stdout=log, stderr=subprocess.STDOUT)
+    qemu = subprocess.Popen(
+        [args.qemu, '-nographic', '-machine', 'esp32c3',
+         '-icount', str(args.icount),
+         '-drive', 'file=%s,if=mtd,format=raw' % image,
+         '-nic', 'user,model=open_eth',
+         '-global', 'driver=timer.esp32c3.timg,property=wdt_disable,'
+         'value=true'],
+        stdin=subprocess.DEVNULL, stdout=subprocess.PIPE,
+        stderr=subprocess.STDOUT, text=True, errors='replace')
+    # a wedged emulator would otherwise leave the read below hanging
+    timer = threading.Timer(args.timeout, qemu.kill)
+    timer.start()
+    wakes = []
+    done = False
+    try:
+        for line in qemu.stdout:
+            line = line.rstrip()
+            if args.verbose:
+                print(line, flush=True)
+            if SIM_LINE.match(line):
+                wakes.append(parse_sim(line))
+                if not args.verbose:
+                    print('\rwake %d' % len(wakes), end='', file=sys.stderr,
+                          flush=True)
+            elif line.startswith('SIM done'):
+                done = True
+                break
+    finally:
+        timer.cancel()
+        qemu.kill()
+        standin.terminate()
+        qemu.wait()
+        standin.wait()
+        log.close()
+    if not args.verbose:
+        print(file=sys.stderr)
+    if not done:
+        print('the run did not finish; see -v', file=sys.stderr)
+    return wakes, done
+
+
+def totals(wakes):
+    return {k: sum(w[k] for w in wakes) for k in TOTALS}
+
+
+def standin_timing(build):
+    try:
+        with open(os.path.join(build, 'standin-timing.jsonl')) as f:
+            return [json.loads(line) for line in f]
+    except FileNotFoundError:
+        return []
+
+
+def mean(v):
+    return sum(v) / len(v) if v else 0
+
+
+def report_timing(reqs):
+    if not reqs:
+        return
+    done = [r for r in reqs if r['status']]
+    hs = [r['handshake_ms'] for r in reqs if 'handshake_ms' in r]
+    full = [r['handshake_ms'] for r in reqs
+            if 'handshake_ms' in r and not r['resumed']]
+    resumed = [r['handshake_ms'] for r in reqs if r.get('resumed')]
+    print('stand-in: %d connections, %d answered, %d dropped, %d failed; '
+          'handshake %.1f ms mean (%d full at %.1f ms, %d resumed at '
+          '%.1f ms), total %.1f ms mean, %d TLS bytes in, %d out' %
+          (len(reqs), len(done), sum(1 for r in reqs if r.get('dropped')),
+           sum(1 for r in reqs if 'error' in r), mean(hs), len(full),
+           mean(full), len(resumed), mean(resumed),
+           mean([r['total_ms'] for r in reqs]),
+           sum(r['bytes_in'] for r in reqs),
+           sum(r['bytes_out'] for r in reqs)))
+
+
+def report(wakes, base):
+    print('%4s %5s %5s %9s %11s %4s %4s %4s %8s %8s' %
+          ('wake', 'flame', 'batt', 'awake ms', 'cycles', 'req', 'fail',
+           'coap', 'tx B', 'rx B'))
+    for w in wakes:
+        print('%4d %5d %5d %9.1f %11d %4d %4d %4d %8d %8d' %
+              (w['wake'], w['flame_mv'], w['batt_mv'], w['awake_us'] / 1000,
+               w['cycles'], w['requests'], w['failed'], w['coap'],
+               w['tx_bytes'], w['rx_bytes']))
+    t = totals(wakes)
+    net = [w for w in wakes if w['tx_frames']]
+    print('%d wakes, %d with the network; %.1f s awake, %d cycles, '
+          '%d requests (%d failed), %d coap (%d lost), %d bytes out in '
+          '%d frames, %d bytes in in %d frames' %
+          (len(wakes), len(net), t['awake_us'] / 1e6, t['cycles'],
+           t['requests'], t['failed'], t['coap'], t['coap_lost'],
+           t['tx_bytes'], t['tx_frames'], t['rx_bytes'], t['rx_frames']))
+    if base:
+        b = totals(base)
+        if len(base) != len(wakes):
+            print('note: the baseline has %d wakes' % len(base))
+        for k in TOTALS:
+            if b[k] != t[k]:
+                print('  %-10s %12d -> %12d  (%+.1f%%)' %
+                      (k, b[k], t[k],
+                       100.0 * (t[k] - b[k]) / b[k] if b[k] else 0))
+
+
+def main():
+    ap = argparse.ArgumentParser()
+    ap.add_argument('build', help='a build directory configured for QEMU')
+    ap.add_argument('-v', '--verbose', action='store_true',
+                    help='echo the console')
+    ap.add_argument('--qemu', default=os.environ.get('QEMU',
+                                                     'qemu-system-riscv32'))
+    ap.add_argument('--icount', type=int, default=3,
+                    help='QEMU -icount shift (default 3)')
+    ap.add_argument('--timeout', type=int, default=1800,
+                    help='give up after this many seconds')
+    ap.add_argument('--json', help='save the per-wake figures')
+    ap.add_argument('--compare', help='a saved run to compare with')
+    ap.add_argument('--latency', type=float, default=0,
+                    help='ms the stand-in adds to each flight it sends')
+    ap.add_argument('--loss', type=float, default=0,
+                    help='chance a stand-in flight waits out a retransmit')
+    ap.add_argument('--drop', type=float, default=0,
+                    help='chance the stand-in closes without a reply')
+    ap.add_argument('--resumption', choices=('tickets', 'off'),
+                    default='tickets',
+                    help='whether the stand-in issues session tickets')
+    args = ap.parse_args()
+
+    cfg = build_config(args.build)
+    if not cfg.get('PLM_QEMU'):
+        print('%s is not a PLM_QEMU build; configure it with '
+              'SDKCONFIG_DEFAULTS="sdkconfig.defaults;sdkconfig.qemu"' %
+              args.build, file=sys.stderr)
+        return 1
+    base = None
+    if args.compare:
+        with open(args.compare) as f:
+            base = json.load(f)
+    wakes, done = run(args, cfg)
+    if not wakes:
+        return 1
+    report(wakes, base)
+    report_timing(standin_timing(args.build))
+    if args.json:
+        with open(args.json, 'w') as f:
+            json.dump(wakes, f, indent=1)
+    return 0 if done else 1
+
+
+if __name__ == '__main__':
+    sys.exit(main())
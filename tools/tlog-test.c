@@ -0,0 +1,306 @@
+/* Pilot Light Monitor
+ *
+ * Copyright 2023 Vernon Mauery <vernon@mauery.org>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+// Run main/tlog.c against a fake tlog partition and check what it
+// uploads the way the server's ingest endpoint reads it.
+//
+// build: cc -O2 -Ihost -I../main -o tlog-test tlog-test.c
+// usage: ./tlog-test
+//
+// Prints each mismatch and exits non-zero if there are any. It checks
+// that:
+//   every record is uploaded once, in the order it was logged
+//   no record is ahead of the upload's clock, even one logged before a
+//     power cut reset the RTC, so the server needn't guess its time
+//   the records keep their spacing once the server stamps them
+//   pages already sent stay sent through a reset, even before their
+//     sector is erased
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../main/tlog.c"
+
+static int failures;
+
+#define CHECK(cond, ...)                                                      \
+    do                                                                        \
+    {                                                                         \
+        if (!(cond))                                                          \
+        {                                                                     \
+            printf(__VA_ARGS__);                                              \
+            printf("\n");                                                     \
+            failures++;                                                       \
+        }                                                                     \
+    } while (0)
+
+const char* TAG = "tlog-test";
+
+const char* device_id(void)
+{
+    return "test";
+}
+
+uint32_t esp_random(void)
+{
+    return rand();
+}
+
+uint16_t esp_rom_crc16_le(uint16_t crc, const uint8_t* buf, uint32_t len)
+{
+    while (len--)
+    {
+        crc = (crc >> 8) ^ (crc << 8) ^ *buf++;
+    }
+    return crc;
+}
+
+#define FLASH_SECTORS 4
+static uint8_t flash[FLASH_SECTORS * TLOG_SECTOR_SIZE];
+static const esp_partition_t part = {0, sizeof(flash)};
+
+const esp_partition_t* esp_partition_find_first(int type, int subtype,
+                                                const char* label)
+{
+    return &part;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t* p, size_t offset,
+                             void* dst, size_t len)
+{
+    memcpy(dst, flash + offset, len);
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_write(const esp_partition_t* p, size_t offset,
+                              const void* src, size_t len)
+{
+    const uint8_t* s = src;
+    for (size_t i = 0; i < len; i++)
+    {
+        // NOR flash can only clear bits
+        CHECK((flash[offset + i] & s[i]) == s[i],
+              "write sets cleared bits at %zu", offset + i);
+        flash[offset + i] &= s[i];
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t* p, size_t offset,
+                                    size_t len)
+{
+    memset(flash + offset, 0xff, len);
+    return ESP_OK;
+}
+
+// the server: the real time of each upload, and the stamped ticks it
+// has taken so far
+static int net_up;
+static long server_time;
+static long stamped[4096];
+static int stamped_ticks[4096];
+static int received;
+
+int https_post(const char* uri, const char* data, const char* content_type,
+               const char* user, const char* passwd)
+{
+    if (!net_up)
+    {
+        return -1;
+    }
+    unsigned long now;
+    unsigned long batch;
+    int n;
+    if (sscanf(data, "now=%lu\nbatch=%lu\n%n", &now, &batch, &n) != 2)
+    {
+        CHECK(0, "upload header: %.40s", data);
+        return 400;
+    }
+    for (const char* line = data + n; *line;)
+    {
+        unsigned long sec;
+        unsigned long tick;
+        unsigned flame_v;
+        unsigned batt_v;
+        int len;
+        if (sscanf(line, "%lu: t=%lu, flame_v=%u, batt_v=%u\n%n", &sec,
+                   &tick, &flame_v, &batt_v, &len) != 4)
+        {
+            CHECK(0, "upload line: %.60s", line);
+            return 400;
+        }
+        CHECK(sec <= now, "tick %lu at %lu is ahead of the clock at %lu",
+              tick, sec, now);
+        if (received < 4096)
+        {
+            stamped[received] = server_time - (long)(now - sec);
+            stamped_ticks[received] = tick;
+            received++;
+        }
+        line += len;
+    }
+    return 200;
+}
+
+// a power cut: RTC memory comes back zeroed, the flash doesn't
+static void power_cut(void)
+{
+    memset(&tlog_buf, 0, sizeof(tlog_buf));
+    tlog_seq = 0;
+    tlog_head = 0;
+    tlog_tail = 0;
+    tlog_backlog = 0;
+    tlog_pending = 0;
+    tlog_base = 0;
+}
+
+#define TICK_SEC 60
+
+// Log pages worth of ticks from RTC second rtc0, counting ticks from
+// *tick; returns the RTC seconds after the last one
+static long log_ticks(long rtc0, int* tick, int count)
+{
+    long rtc = rtc0;
+    for (int i = 0; i < count; i++)
+    {
+        tlog_add(rtc, (*tick)++, 10 + i % 7, 2000);
+        rtc += TICK_SEC;
+    }
+    return rtc;
+}
+
+// everything logged since tick first came up once, in order, a tick
+// apart, except across the power cut at cut_tick (-1 for none)
+static void check_received(int first, int last, int cut_tick)
+{
+    CHECK(received == last - first, "%d records uploaded, want %d", received,
+          last - first);
+    for (int i = 0; i < received; i++)
+    {
+        CHECK(stamped_ticks[i] == first + i, "record %d is tick %d, want %d",
+              i, stamped_ticks[i], first + i);
+        if (i == 0)
+        {
+            continue;
+        }
+        long gap = stamped[i] - stamped[i - 1];
+        if (stamped_ticks[i] == cut_tick)
+        {
+            CHECK(gap > 0, "tick %d stamped %ld s after the one before it",
+                  cut_tick, gap);
+        }
+        else
+        {
+            CHECK(gap == TICK_SEC, "tick %d stamped %ld s after tick %d",
+                  stamped_ticks[i], gap, stamped_ticks[i - 1]);
+        }
+    }
+}
+
+// an outage that outlives a power cut: pages from before the cut still
+// go up with the ones after, and the RTC started over at zero
+static void test_power_cut(void)
+{
+    memset(flash, 0xff, sizeof(flash));
+    power_cut();
+    received = 0;
+    net_up = 0;
+    int tick = 0;
+    tlog_init(1, 3);
+    tlog_outage();
+    // whole pages, since what is still in RTC goes with the power
+    log_ticks(100000, &tick, 5 * TLOG_RECS);
+    int cut = tick;
+
+    power_cut();
+    tlog_init(1, 3);
+    CHECK(tlog_pending, "backlog forgotten after the power cut");
+    long rtc = log_ticks(3, &tick, 3 * TLOG_RECS + 4);
+
+    net_up = 1;
+    server_time = 1700000000;
+    CHECK(tlog_upload(rtc), "upload failed");
+    CHECK(tlog_backlog == 0, "%d pages left after the upload", tlog_backlog);
+    // the five pages before the cut, what made it to flash after it and
+    // the records still in RTC
+    check_received(0, tick, cut);
+}
+
+// the RTC can keep counting through a reset that isn't a power cut;
+// then there's nothing to carry over
+static void test_warm_reset(void)
+{
+    memset(flash, 0xff, sizeof(flash));
+    power_cut();
+    received = 0;
+    net_up = 0;
+    int tick = 0;
+    tlog_init(1, 3);
+    tlog_outage();
+    long rtc = log_ticks(1000, &tick, 2 * TLOG_RECS);
+
+    power_cut();
+    tlog_init(1, rtc);
+    CHECK(tlog_base == 0, "clock moved %lu s with the RTC still counting",
+          (unsigned long)tlog_base);
+    rtc = log_ticks(rtc, &tick, TLOG_RECS / 2);
+
+    net_up = 1;
+    server_time = 1700000000;
+    CHECK(tlog_upload(rtc), "upload failed");
+    check_received(0, tick, -1);
+}
+
+// part of a sector goes up, then a new outage and a power cut: the
+// pages already sent must not come back with the new ones
+static void test_sent_then_cut(void)
+{
+    memset(flash, 0xff, sizeof(flash));
+    power_cut();
+    received = 0;
+    net_up = 0;
+    int tick = 0;
+    tlog_init(1, 3);
+    tlog_outage();
+    long rtc = log_ticks(3, &tick, 5 * TLOG_RECS + 3);
+    net_up = 1;
+    server_time = 1700000000;
+    CHECK(tlog_upload(rtc), "upload failed");
+    CHECK(tlog_backlog == 0, "%d pages left after the upload", tlog_backlog);
+    int first = tick;
+
+    received = 0;
+    net_up = 0;
+    tlog_outage();
+    rtc = log_ticks(rtc, &tick, 2 * TLOG_RECS);
+    power_cut();
+    tlog_init(1, 3);
+    CHECK(tlog_backlog == 2, "%d pages of backlog after the power cut, "
+          "want 2", tlog_backlog);
+    rtc = log_ticks(3, &tick, TLOG_RECS / 2);
+
+    net_up = 1;
+    server_time += 3600;
+    CHECK(tlog_upload(rtc), "upload failed");
+    check_received(first, tick, first + 2 * TLOG_RECS);
+}
+
+int main(void)
+{
+    test_power_cut();
+    test_warm_reset();
+    test_sent_then_cut();
+    if (failures)
+    {
+        printf("%d failures\n", failures);
+        return 1;
+    }
+    printf("tlog ok\n");
+    return 0;
+}
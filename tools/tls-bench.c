@@ -0,0 +1,259 @@
+/* Pilot Light Monitor
+ *
+ * Copyright 2023 Vernon Mauery <vernon@mauery.org>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+// Time TLS handshakes with the uptime host from a PC, using mbedTLS as
+// the firmware does, and report how much heap each one needed.
+// Run it once with the pinned CA and once with a full CA bundle to see
+// what pinning saves before flashing either build.
+//
+// build: cc -O2 -o tls-bench tls-bench.c -lmbedtls -lmbedx509 -lmbedcrypto
+// usage: ./tls-bench [-n rounds] <host> <ca.pem>
+//   e.g. ./tls-bench example.com ../main/certs/uptime_ca.pem
+//        ./tls-bench example.com /etc/ssl/certs/ca-certificates.crt
+//
+// Each round parses the CA file, connects, and does a full handshake
+// with certificate verification; the times are split between the two.
+// Peak heap counts what mbedTLS allocates in a round, which needs an
+// mbedTLS built with MBEDTLS_PLATFORM_MEMORY. The firmware's bundle
+// mode doesn't parse the whole bundle up front, so with a bundle file
+// the parse time and heap here are an upper bound for it; the
+// handshake figures compare directly.
+
+#include <mbedtls/ctr_drbg.h>
+#include <mbedtls/entropy.h>
+#include <mbedtls/error.h>
+#include <mbedtls/net_sockets.h>
+#include <mbedtls/platform.h>
+#include <mbedtls/ssl.h>
+#include <mbedtls/x509_crt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*---------------------------------------------------------------
+        Heap accounting
+---------------------------------------------------------------*/
+// each block carries its size ahead of it so free knows what to give
+// back; 16 bytes keeps the block aligned
+#define HDR 16
+
+static size_t heap_now;
+static size_t heap_peak;
+
+static void* count_calloc(size_t n, size_t size)
+{
+    if (size && n > (SIZE_MAX - HDR) / size)
+    {
+        return NULL;
+    }
+    size_t len = n * size;
+    unsigned char* p = calloc(1, len + HDR);
+    if (!p)
+    {
+        return NULL;
+    }
+    *(size_t*)p = len;
+    heap_now += len;
+    if (heap_now > heap_peak)
+    {
+        heap_peak = heap_now;
+    }
+    return p + HDR;
+}
+
+static void count_free(void* ptr)
+{
+    if (!ptr)
+    {
+        return;
+    }
+    unsigned char* p = (unsigned char*)ptr - HDR;
+    heap_now -= *(size_t*)p;
+    free(p);
+}
+
+static int64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void tls_error(const char* what, int ret)
+{
+    char buf[128];
+    mbedtls_strerror(ret, buf, sizeof(buf));
+    fprintf(stderr, "%s: -0x%04x %s\n", what, (unsigned)-ret, buf);
+}
+
+struct round
+{
+    int64_t parse_us;
+    int64_t handshake_us;
+    size_t peak;
+};
+
+// one full connection; returns 0 on success
+static int bench_round(const char* host, const char* ca_file,
+                       mbedtls_ctr_drbg_context* drbg, struct round* r)
+{
+    mbedtls_x509_crt ca;
+    mbedtls_ssl_config conf;
+    mbedtls_ssl_context ssl;
+    mbedtls_net_context net;
+    int ret;
+
+    heap_now = 0;
+    heap_peak = 0;
+    int64_t start = now_us();
+    mbedtls_x509_crt_init(&ca);
+    mbedtls_ssl_config_init(&conf);
+    mbedtls_ssl_init(&ssl);
+    mbedtls_net_init(&net);
+    // a bundle can hold certificates this mbedTLS can't parse; a
+    // positive return is how many were skipped
+    if ((ret = mbedtls_x509_crt_parse_file(&ca, ca_file)) < 0)
+    {
+        tls_error("parse ca", ret);
+        goto out;
+    }
+    r->parse_us = now_us() - start;
+
+    start = now_us();
+    if ((ret = mbedtls_net_connect(&net, host, "443",
+                                   MBEDTLS_NET_PROTO_TCP)) != 0)
+    {
+        tls_error("connect", ret);
+        goto out;
+    }
+    int64_t connected = now_us();
+    if ((ret = mbedtls_ssl_config_defaults(&conf, MBEDTLS_SSL_IS_CLIENT,
+                                           MBEDTLS_SSL_TRANSPORT_STREAM,
+                                           MBEDTLS_SSL_PRESET_DEFAULT)) != 0)
+    {
+        tls_error("config", ret);
+        goto out;
+    }
+    mbedtls_ssl_conf_authmode(&conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+    mbedtls_ssl_conf_ca_chain(&conf, &ca, NULL);
+    mbedtls_ssl_conf_rng(&conf, mbedtls_ctr_drbg_random, drbg);
+    if ((ret = mbedtls_ssl_setup(&ssl, &conf)) != 0 ||
+        (ret = mbedtls_ssl_set_hostname(&ssl, host)) != 0)
+    {
+        tls_error("setup", ret);
+        goto out;
+    }
+    mbedtls_ssl_set_bio(&ssl, &net, mbedtls_net_send, mbedtls_net_recv,
+                        NULL);
+    while ((ret = mbedtls_ssl_handshake(&ssl)) != 0)
+    {
+        if (ret != MBEDTLS_ERR_SSL_WANT_READ &&
+            ret != MBEDTLS_ERR_SSL_WANT_WRITE)
+        {
+            tls_error("handshake", ret);
+            goto out;
+        }
+    }
+    r->handshake_us = now_us() - connected;
+    mbedtls_ssl_close_notify(&ssl);
+
+out:
+    mbedtls_net_free(&net);
+    mbedtls_ssl_free(&ssl);
+    mbedtls_ssl_config_free(&conf);
+    mbedtls_x509_crt_free(&ca);
+    r->peak = heap_peak;
+    return ret < 0 ? ret : 0;
+}
+
+int main(int argc, char* argv[])
+{
+    int rounds = 5;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'n':
+                rounds = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-n rounds] <host> <ca.pem>\n",
+                        argv[0]);
+                return 1;
+        }
+    }
+    if (argc - optind != 2 || rounds < 1)
+    {
+        fprintf(stderr, "usage: %s [-n rounds] <host> <ca.pem>\n", argv[0]);
+        return 1;
+    }
+    const char* host = argv[optind];
+    const char* ca_file = argv[optind + 1];
+
+#if defined(MBEDTLS_PLATFORM_MEMORY)
+    mbedtls_platform_set_calloc_free(count_calloc, count_free);
+    int counted = 1;
+#else
+    int counted = 0;
+    (void)count_calloc;
+    (void)count_free;
+#endif
+
+    mbedtls_entropy_context entropy;
+    mbedtls_ctr_drbg_context drbg;
+    mbedtls_entropy_init(&entropy);
+    mbedtls_ctr_drbg_init(&drbg);
+    int ret = mbedtls_ctr_drbg_seed(&drbg, mbedtls_entropy_func, &entropy,
+                                    (const unsigned char*)"tls-bench", 9);
+    if (ret != 0)
+    {
+        tls_error("seed", ret);
+        return 1;
+    }
+
+    int ok = 0;
+    int64_t parse = 0;
+    int64_t handshake = 0;
+    int64_t worst = 0;
+    size_t peak = 0;
+    for (int i = 0; i < rounds; i++)
+    {
+        struct round r = {0};
+        if (bench_round(host, ca_file, &drbg, &r) != 0)
+        {
+            printf("%d: failed\n", i);
+            continue;
+        }
+        printf("%d: parse %.1f ms, handshake %.1f ms, peak heap %zu\n", i,
+               r.parse_us / 1000.0, r.handshake_us / 1000.0, r.peak);
+        ok++;
+        parse += r.parse_us;
+        handshake += r.handshake_us;
+        worst = (r.handshake_us > worst) ? r.handshake_us : worst;
+        peak = (r.peak > peak) ? r.peak : peak;
+    }
+    if (ok)
+    {
+        printf("%s with %s: %d/%d ok, parse %.1f ms, handshake mean %.1f ms, "
+               "worst %.1f ms",
+               host, ca_file, ok, rounds, parse / 1000.0 / ok,
+               handshake / 1000.0 / ok, worst / 1000.0);
+        if (counted)
+        {
+            printf(", peak heap %zu bytes", peak);
+        }
+        printf("\n");
+    }
+    mbedtls_ctr_drbg_free(&drbg);
+    mbedtls_entropy_free(&entropy);
+    return ok ? 0 : 1;
+}
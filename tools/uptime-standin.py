@@ -0,0 +1,456 @@
+#!/usr/bin/env python3
+#
+# Pilot Light Monitor
+#
+# Copyright 2023 Vernon Mauery <vernon@mauery.org>
+#
+# SPDX-License-Identifier: BSD-3-Clause
+#
+
+# A stand-in for the uptime host (php/index.php) and the Twilio API, to
+# point a monitor at when there is no server to hand, such as the QEMU
+# build (tools/qemu-bench.py) or a board on the bench. It answers every
+# endpoint the firmware and the PHP scripts use the way the real ones
+# do, but stores nothing.
+#
+# usage: ./uptime-standin.py [--port 8443] [--certs <dir>]
+#                            [--latency ms] [--loss p] [--drop p]
+#                            [--resumption tickets|off] [--timing <file>]
+#        ./uptime-standin.py --make-certs <dir> <host name or IP>...
+#
+# Every request is printed with how long its TLS handshake, request and
+# reply took and how many bytes of TLS went each way; --timing also
+# appends them to a file as JSON lines. The network can be made worse
+# on purpose:
+#   --latency  delay each flight the server sends by this many ms, as a
+#              round trip would
+#   --loss     give each flight this chance of waiting out a TCP
+#              retransmit (--rto ms) first, as a lost segment would
+#   --drop     give each connection this chance of being closed after
+#              the request arrives, without a reply
+#   --resumption off  refuses both session tickets and session IDs, so
+#              every handshake is a full one; the timing shows which
+#              handshakes were resumed
+#
+# By default it serves tools/standin/server.pem, made for QEMU's view
+# of the PC (10.0.2.2) and localhost and signed by the test CA in
+# tools/standin/uptime_ca.pem, which a PLM_QEMU build trusts. For a
+# board, make a CA and certificate for the name or address it will use,
+# then build the board with that uptime_ca.pem in main/certs/ and
+# PLM_TLS_PINNED_CA set (see the README).
+
+import argparse
+import http
+import ipaddress
+import json
+import os
+import random
+import re
+import socket
+import socketserver
+import ssl
+import subprocess
+import sys
+import threading
+import time
+from urllib.parse import parse_qs, urlsplit
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+
+INGEST_RECORD = re.compile(
+    r'^([0-9]{1,10}): ([a-z_]+=[-0-9.]+(, [a-z_]+=[-0-9.]+)*)$')
+
+MAX_HEADER = 16384
+
+
+class Dropped(Exception):
+    pass
+
+
+# One connection's TLS, run over memory BIOs so that every byte on the
+# wire is counted and each flight can be held back on its way out
+class TlsConn:
+    def __init__(self, sock, ctx, opts):
+        self.sock = sock
+        self.opts = opts
+        self.inc = ssl.MemoryBIO()
+        self.out = ssl.MemoryBIO()
+        self.tls = ctx.wrap_bio(self.inc, self.out, server_side=True)
+        self.bytes_in = 0
+        self.bytes_out = 0
+        self.first_byte = None
+
+    def flush(self):
+        data = self.out.read()
+        if not data:
+            return
+        delay = self.opts.latency
+        if random.random() < self.opts.loss:
+            delay += self.opts.rto
+        if delay:
+            time.sleep(delay / 1000.0)
+        self.sock.sendall(data)
+        self.bytes_out += len(data)
+
+    def fill(self):
+        data = self.sock.recv(16384)
+        if not data:
+            raise EOFError()
+        if self.first_byte is None:
+            self.first_byte = time.monotonic()
+        self.bytes_in += len(data)
+        self.inc.write(data)
+
+    def _retry(self, op, *args):
+        while True:
+            try:
+                ret = op(*args)
+                self.flush()
+                return ret
+            except ssl.SSLWantReadError:
+                self.flush()
+                self.fill()
+
+    def handshake(self):
+        self._retry(self.tls.do_handshake)
+
+    def read(self, n):
+        try:
+            return self._retry(self.tls.read, n)
+        except ssl.SSLZeroReturnError:
+            return b''
+
+    def write(self, data):
+        self.tls.write(data)
+        self.flush()
+
+    def close(self):
+        try:
+            self.tls.unwrap()
+        except (ssl.SSLError, OSError):
+            pass
+        try:
+            self.flush()
+        except OSError:
+            pass
+
+
+class Request:
+    def __init__(self, method, target, headers, body):
+        self.method = method
+        self.path = urlsplit(target).path
+        self.headers = headers
+        self.body = body.decode('utf-8', 'replace')
+
+
+def read_request(conn):
+    buf = b''
+    while b'\r\n\r\n' not in buf:
+        data = conn.read(4096)
+        if not data or len(buf) > MAX_HEADER:
+            return None
+        buf += data
+    head, body = buf.split(b'\r\n\r\n', 1)
+    lines = head.decode('latin-1').split('\r\n')
+    parts = lines[0].split()
+    if len(parts) != 3:
+        return None
+    headers = {}
+    for line in lines[1:]:
+        k, _, v = line.partition(':')
+        headers[k.strip().lower()] = v.strip()
+    n = int(headers.get('content-length', 0))
+    while len(body) < n:
+        data = conn.read(n - len(body))
+        if not data:
+            return None
+        body += data
+    return Request(parts[0], parts[1], headers, body[:n])
+
+
+def reply(status, body=b'', content_type='text/html'):
+    return status, body, content_type
+
+
+def json_reply(status, obj):
+    return reply(status, (json.dumps(obj) + '\n').encode(),
+                 'application/json')
+
+
+# the same routes as process_query() in php/index.php
+def route(req):
+    m = re.match(r'^/2010-04-01/Accounts/([^/]+)/Messages\.json$', req.path)
+    if m:
+        return twilio(req, m.group(1))
+    if not req.path.startswith('/uptime/'):
+        return reply(404)
+    q = req.path[len('/uptime/'):]
+    if q in ('log', 'log/'):
+        # older firmware POSTed its backlog here
+        if req.method == 'POST':
+            return ingest(req.body)
+        return reply(200)
+    if q in ('ingest', 'ingest/'):
+        if req.method != 'POST':
+            return reply(405)
+        return ingest(req.body)
+    if q.startswith('report/'):
+        if q.endswith('/'):
+            return reply(404)
+        return reply(204)
+    if q.startswith('alert/'):
+        if q.endswith('/'):
+            return reply(404)
+        return alert(req)
+    if q.startswith('capture'):
+        return reply(200)
+    if q == '':
+        return reply(200, b'<html><body>uptime</body></html>\n')
+    # anything else is a watchdog ping
+    return reply(200, b'<html><body>Thank you for reporting %s'
+                 b'</body></html>\n' % q.encode())
+
+
+# check an alert's shape the way alert_data() does; there's no key
+# here to check its mac with
+def alert(req):
+    if req.method != 'POST':
+        return reply(405)
+    form = parse_qs(req.body)
+    id_ = form.get('id', [''])[0]
+    msg = form.get('msg', [''])[0]
+    mac = form.get('mac', [''])[0]
+    if (not id_.isdigit() or msg == '' or len(msg) > 320 or
+            not re.match(r'^[0-9a-f]{32}$', mac)):
+        return reply(400)
+    return reply(204)
+
+
+# check an upload the way ingest_data() does, and say it was all new
+def ingest(body):
+    now = None
+    batch = None
+    records = 0
+    for n, line in enumerate(body.split('\n'), 1):
+        if line == '':
+            continue
+        m = re.match(r'^now=([0-9]{1,10})$', line)
+        b = re.match(r'^batch=([0-9]{1,10})$', line)
+        r = INGEST_RECORD.match(line)
+        if now is None and m:
+            now = int(m.group(1))
+        elif batch is None and now is not None and b:
+            batch = int(b.group(1))
+        elif now is not None and r:
+            records += 1
+        else:
+            return json_reply(400, {'batch': batch,
+                                    'error': 'bad line %d' % n})
+    if not records:
+        return json_reply(400, {'batch': batch, 'error': 'no records'})
+    return json_reply(200, {'batch': batch, 'records': records,
+                            'accepted': records})
+
+
+# POST /2010-04-01/Accounts/<sid>/Messages.json, as sms-sender.php sends
+# it through twilio-php
+def twilio(req, sid):
+    if req.method != 'POST':
+        return reply(405)
+    f = parse_qs(req.body)
+    if 'To' not in f or 'Body' not in f:
+        return json_reply(400, {'code': 21604, 'status': 400,
+                                'message': 'A parameter is missing'})
+    return json_reply(201, {
+        'sid': 'SM%032x' % int(time.time() * 1000000),
+        'account_sid': sid,
+        'to': f['To'][0],
+        'from': f.get('From', [''])[0],
+        'body': f['Body'][0],
+        'status': 'queued',
+    })
+
+
+class Handler(socketserver.BaseRequestHandler):
+    def handle(self):
+        opts = self.server.opts
+        t = {'time': time.time(), 'client': self.client_address[0]}
+        start = time.monotonic()
+        conn = TlsConn(self.request, self.server.tls_context(), opts)
+        status = None
+        try:
+            conn.handshake()
+            hs_done = time.monotonic()
+            t['handshake_ms'] = ms(hs_done - (conn.first_byte or start))
+            t['resumed'] = conn.tls.session_reused
+            t['version'] = conn.tls.version()
+            req = read_request(conn)
+            req_done = time.monotonic()
+            t['request_ms'] = ms(req_done - hs_done)
+            if req is None:
+                raise EOFError()
+            t['method'] = req.method
+            t['path'] = req.path
+            if random.random() < opts.drop:
+                raise Dropped()
+            status, body, ctype = route(req)
+            head = 'HTTP/1.1 %d %s\r\n' % (status,
+                                           http.HTTPStatus(status).phrase)
+            if body:
+                head += 'Content-Type: %s\r\n' % ctype
+            head += ('Content-Length: %d\r\nConnection: close\r\n\r\n' %
+                     len(body))
+            conn.write(head.encode() + body)
+            t['reply_ms'] = ms(time.monotonic() - req_done)
+            conn.close()
+        except Dropped:
+            t['dropped'] = True
+        except (EOFError, OSError, ssl.SSLError) as e:
+            t['error'] = str(e) or type(e).__name__
+        t['status'] = status
+        t['total_ms'] = ms(time.monotonic() - start)
+        t['bytes_in'] = conn.bytes_in
+        t['bytes_out'] = conn.bytes_out
+        self.server.record(t)
+
+
+def ms(sec):
+    return round(sec * 1000, 1)
+
+
+class Server(socketserver.ThreadingTCPServer):
+    daemon_threads = True
+    allow_reuse_address = True
+
+    def __init__(self, opts):
+        self.opts = opts
+        self.ctx = tls_context(opts)
+        self.lock = threading.Lock()
+        self.timing = open(opts.timing, 'a') if opts.timing else None
+        super().__init__(('', opts.port), Handler)
+
+    # Without tickets a TLS 1.2 client can still resume from the session
+    # cache, which ssl has no way to turn off; a context of its own for
+    # each connection leaves it nothing to resume from.
+    def tls_context(self):
+        if self.opts.resumption == 'off':
+            return tls_context(self.opts)
+        return self.ctx
+
+    def record(self, t):
+        what = ('dropped' if t.get('dropped') else
+                t.get('error') or str(t['status']))
+        line = ('%s %s %s %s -> %s, handshake %s ms%s, request %s ms, '
+                'reply %s ms, total %s ms, %d bytes in, %d out' %
+                (time.strftime('%H:%M:%S', time.localtime(t['time'])),
+                 t['client'], t.get('method', '-'), t.get('path', '-'), what,
+                 t.get('handshake_ms', '-'),
+                 ' (resumed)' if t.get('resumed') else '',
+                 t.get('request_ms', '-'), t.get('reply_ms', '-'),
+                 t['total_ms'], t['bytes_in'], t['bytes_out']))
+        with self.lock:
+            print(line, flush=True)
+            if self.timing:
+                self.timing.write(json.dumps(t) + '\n')
+                self.timing.flush()
+
+
+def tls_context(opts):
+    ctx = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+    ctx.load_cert_chain(os.path.join(opts.certs, 'server.pem'),
+                        os.path.join(opts.certs, 'server.key'))
+    if opts.resumption == 'off':
+        ctx.options |= ssl.OP_NO_TICKET
+        ctx.num_tickets = 0
+    return ctx
+
+
+def openssl(*args):
+    subprocess.run(('openssl',) + args, check=True,
+                   stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+
+
+# A test CA (kept if there is one already) and a server certificate it
+# signs for the given names and addresses. P-256 keeps the handshake
+# cheap for the monitor.
+def make_certs(out, names):
+    os.makedirs(out, exist_ok=True)
+    ca = os.path.join(out, 'uptime_ca.pem')
+    ca_key = os.path.join(out, 'uptime_ca.key')
+    if not os.path.exists(ca):
+        openssl('ecparam', '-name', 'prime256v1', '-genkey', '-noout',
+                '-out', ca_key)
+        openssl('req', '-x509', '-new', '-key', ca_key, '-sha256',
+                '-days', '7300',
+                '-subj', '/CN=pilot-light-monitor stand-in CA',
+                '-addext', 'basicConstraints=critical,CA:TRUE',
+                '-addext', 'keyUsage=critical,keyCertSign,cRLSign',
+                '-out', ca)
+    san = []
+    for name in names:
+        try:
+            ipaddress.ip_address(name)
+            # older mbedTLS only matches names, newer only addresses
+            san += ['IP:' + name, 'DNS:' + name]
+        except ValueError:
+            san.append('DNS:' + name)
+    key = os.path.join(out, 'server.key')
+    csr = os.path.join(out, 'server.csr')
+    ext = os.path.join(out, 'server.ext')
+    with open(ext, 'w') as f:
+        f.write('subjectAltName=%s\nbasicConstraints=CA:FALSE\n'
+                'extendedKeyUsage=serverAuth\n' % ','.join(san))
+    openssl('ecparam', '-name', 'prime256v1', '-genkey', '-noout',
+            '-out', key)
+    openssl('req', '-new', '-key', key, '-subj', '/CN=' + names[0],
+            '-out', csr)
+    openssl('x509', '-req', '-in', csr, '-CA', ca, '-CAkey', ca_key,
+            '-set_serial', str(int(time.time())), '-days', '7300',
+            '-sha256', '-extfile', ext, '-out',
+            os.path.join(out, 'server.pem'))
+    os.remove(csr)
+    os.remove(ext)
+    print('%s: server.pem for %s, signed by uptime_ca.pem' %
+          (out, ', '.join(names)))
+
+
+def main():
+    ap = argparse.ArgumentParser()
+    ap.add_argument('--port', type=int, default=8443)
+    ap.add_argument('--certs', default=os.path.join(HERE, 'standin'),
+                    help='directory with server.pem and server.key')
+    ap.add_argument('--latency', type=float, default=0,
+                    help='ms added to each flight the server sends')
+    ap.add_argument('--loss', type=float, default=0,
+                    help='chance a flight waits out a retransmit')
+    ap.add_argument('--rto', type=float, default=1000,
+                    help='ms a lost flight is held back (default 1000)')
+    ap.add_argument('--drop', type=float, default=0,
+                    help='chance a request is closed without a reply')
+    ap.add_argument('--resumption', choices=('tickets', 'off'),
+                    default='tickets')
+    ap.add_argument('--timing', help='append per-request timing here')
+    ap.add_argument('--seed', type=int,
+                    help='seed the loss and drop choices')
+    ap.add_argument('--make-certs', nargs='+', metavar=('DIR', 'NAME'),
+                    help='make a CA and server certificate, and exit')
+    opts = ap.parse_args()
+
+    if opts.make_certs:
+        if len(opts.make_certs) < 2:
+            ap.error('--make-certs needs a directory and at least one name')
+        make_certs(opts.make_certs[0], opts.make_certs[1:])
+        return 0
+    if opts.seed is not None:
+        random.seed(opts.seed)
+    server = Server(opts)
+    print('uptime stand-in on port %d' % opts.port, flush=True)
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())